@@ -4,291 +4,8609 @@
  *
  * shell.c file:
  * This file creates a very basic C shell for Unix systems.
- * The shell supports basic commands and can either pipe or redirect
- *   outputs.
- *   Only one special case can be handled at a time.
- * History command only stores the last command entered, valid or not.
- *   It will not store a history command.
+ * The shell supports basic commands, pipelines with any number of stages
+ *   (a | b | c) and redirects (< > >> 2> 2>&1 &>) on any stage.
+ * Commands can be joined with ; && || and newlines, and if/elif/else/fi,
+ *   while, until and for x in ... run inside the shell, taking their
+ *   conditions from exit codes, so a loop of builtins never forks.
+ *   An unfinished command is continued on the next line at a > prompt.
+ * NAME=VALUE sets a shell variable (for one command if it comes before
+ *   it), export and unset manage them, and $NAME ${NAME} ${NAME:-WORD}
+ *   $? $! and $$ are expanded each time a command runs, unquoted ones
+ *   split at blanks. The environment commands get is only rebuilt after
+ *   an exported variable changed.
+ * $(...) and `...` are replaced by what the command printed, less its
+ *   trailing newlines; the substitutions of one command run side by side
+ *   in forked copies of the shell and are read together.
+ * Typed lines are read by a line editor with history recall, Ctrl-R search
+ *   and Tab completion of commands and file names (set edit=off gives
+ *   plain terminal input).
+ * History keeps the last 65536 commands entered, valid or not, and
+ *   interactive ones are appended to ~/.osh_history (or $OSH_HISTFILE).
+ *   !! !n !-n and !prefix rerun one, history [N] lists them.
+ *   A history command itself is not stored.
  * The shell has all the same limitations as the terminal it is being
  *   run on, so for example outputs from commands using & will result
  *   in scrambled formatting.
- * There's a known bug where using & can occasionally result in a blank
- *   command line on the current or next command input.
- *   This is just a display issue, the program is still running and
- *     functioning as normal.
- *   Just press Enter to restore the "osh>" prompt
+ * Background commands are reaped as soon as they exit so they don't linger
+ *   as zombies, and are tracked as jobs (jobs, fg, bg, wait and kill).
+ *   The shell waits for typed input, children (SIGCHLD through a signalfd)
+ *   and timers in one epoll loop, so a job finishing while a line is being
+ *   typed is reported right away, and TMOUT=N logs out after N idle
+ *   seconds at a prompt.
+ * cd, pwd, echo, true, false, test/[, export, unset and printf are builtins
+ *   that run inside the shell without starting a process.
+ * Children are reaped with wait4(), time before a command reports its real,
+ *   user and sys time and max RSS, and set acctlog=FILE logs every child.
+ * coproc -n N NAME cmd keeps N copies of a filter running on pipes, and
+ *   coproc -s NAME sends it lines (its arguments or stdin) round robin and
+ *   prints one answer line per request in order, so a filter used on many
+ *   small inputs is executed once instead of once per input.
+ * timeout DURATION cmd signals cmd's whole process group from a timer in
+ *   the event loop once DURATION is up, and ulimit limits (CPU time,
+ *   memory, open files...) are set with setrlimit() in every child between
+ *   fork() and exec, never in the shell.
+ * set cgroup=DIR gives every job a cgroup v2 of its own under DIR (with
+ *   set cpumax= and memmax= for its cpu.max and memory.max), and
+ *   @cpus=0-3 before a pipeline or set cpus= pins jobs to CPUs, spread
+ *   handing each background job the next core; children place themselves
+ *   before exec.
+ * OSH_TRACE=FILE (or set trace=FILE) records when each line was read,
+ *   lexed and parsed, each PATH search, fork and wait, and each child's
+ *   exec, as Chrome trace JSON for a .json FILE (chrome://tracing,
+ *   Perfetto) or else as 40 byte records: start and end ns (u64), pid and
+ *   phase (i32) and 16 bytes of command name, in host byte order.
+ * Each pipeline runs in a process group of its own that gets the terminal
+ *   while it's in the foreground, so ^C and ^Z reach every stage of it and
+ *   never the shell, and a stopped job can be continued with fg or bg.
+ * Build with cc -O2 -o osh shell.c, or cc -O2 -flto -static -o osh shell.c
+ *   for the fastest cold start (no dynamic loader or relocations at exec).
+ *   osh --minimal also skips the banner, history file, line editor and
+ *   stdout buffering, for wrappers that start it many times, and
+ *   osh --bench times both kinds of start next to the other workloads.
  * 
  * Assumptions:
- * Only one special handler will be used at a time (not counting &)
- * This means that the command can contain either an I/O redirect or
- *   a pipe, but not both.
  * Data in existing output files are OK to be overwritten, or are
- *   otherwise backed up (file will be cleared before it receives output)
- * & will only be included as the final character in an input
- *   (no & on the first process of a pipe, e.g. ls & | wc)
+ *   otherwise backed up (file will be cleared before it receives output,
+ *   unless it is appended to with >>)
+ * & only ends a pipeline (no & on the first process of a pipe,
+ *   e.g. ls & | wc), and if, while and for can't be piped or redirected
  */
+#define _GNU_SOURCE     /* splice() */
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_LINE 80 /* The maximum length command */
+#define ARENA_BLOCK 4096 /* Smallest block of a command arena */
 
+enum { READ, WRITE };   /* Pipe ends */
 
-/** -------------------------------- main -------------------------------------
- * The only method used for this program is main()
- * The shell functions by accepting a user input and forking with the child
- *   calling execvp() using the entered text as tokenized arguments
- *   where args[0] is the command to be executed
- * 
- *
- * Assumptions:
- * A space must be included between each argument or separate character
- *   i.e. ls|wc will not work, but ls | wc will
- * If outputting to an existing file the data is okay to be erased or is 
- *   backed up, as this program will erase contents before outputting
- * There are no extra characters following the arguments
- *   i.e. ps -a\n
+/* Ways of starting a child process, picked at runtime with OSH_LAUNCHER or
+ *   "set launcher=..." */
+enum { LAUNCH_FORK, LAUNCH_VFORK, LAUNCH_SPAWN };
+static const char *launcherNames[] = { "fork", "vfork", "spawn" };
+static int launcher = LAUNCH_FORK;
+
+extern char **environ;
+
+/* Capacity asked for every pipe the shell makes ("set pipesize=..."),
+ *   0 keeps the system default, and what the kernel actually gave last */
+static long pipeSize = 0;
+static long lastPipeSize = 0;
+
+/* One redirect of a stage, e.g. 2>>log or 2>&1 */
+typedef struct
+{
+   int fd;                 // Descriptor being redirected
+   int dupFrom;            // Descriptor copied onto fd, or -1 to open file
+   const char *file;
+   int flags;              // open() flags for file
+} Redirect;
+
+/* One command of a pipeline along with its redirects */
+typedef struct
+{
+   char **argv;            // NULL terminated arguments, argv[0] is the command
+   Redirect *redirs;       // Applied in order, after the pipe ends
+   int numRedirs;
+   const char *path;       // Cached location of argv[0], NULL to search PATH
+   char **assigns;         // NAME=VALUE words before the command, exported
+                           //   to it alone, or NULL
+} Stage;
+
+/* Builtins run inside the shell, or in a forked child that never executes
+ *   anything when they are part of a pipeline or run in the background */
+typedef int (*BuiltinFn)(char **args);   /* Returns the exit code */
+typedef struct
+{
+   const char *name;
+   BuiltinFn run;
+} Builtin;
+static const Builtin *findBuiltin(const char *name);
+static const char *builtinName(int b);
+
+/* Set while a builtin's stdin isn't the shell's own, so anything buffered
+ *   in the stdin stream belongs to the shell's input instead */
+static int stdinRedirected = 0;
+
+/* Shell variables, open addressing with linear probing on an FNV-1a hash
+ *   of the name, each kept as one "NAME=VALUE" string so an exported one
+ *   goes into the environment as it is
+ * An unset variable keeps its slot and name, so probing still finds the
+ *   ones past it, until the table is next grown */
+#define VAR_SET 1
+#define VAR_EXPORTED 2
+#define VAR_IN_ENV 4       /* text is in shellEnvp */
+typedef struct
+{
+   char *text;             // "NAME=VALUE", NULL for a slot never used
+   size_t nameLen;
+   int flags;              // VAR_SET, VAR_EXPORTED, VAR_IN_ENV
+} Var;
+static Var *vars = NULL;
+static size_t numVarSlots = 0;   // Power of 2
+static size_t numVarsUsed = 0;   // Slots with a text, unset ones included
+
+/* Environment of the shell's commands (environ points to it), rebuilt from
+ *   the exported variables only once one of them changed
+ *   Texts replaced meanwhile are still in it, so they're freed then */
+static char **shellEnvp = NULL;
+static int envStale = 1;
+static char **retired = NULL;
+static size_t numRetired = 0;
+
+/* Bumped whenever PATH changes, so the command hash and the completion
+ *   index know to start over */
+static unsigned long pathVersion = 1;
+
+
+/** -------------------------------- findVar ----------------------------------
+ * Returns the slot for the first len characters of name, which has no text
+ *   if the name was never used
  */
-int main(void)
+static Var *findVar(const char *name, size_t len)
 {
-   enum { READ, WRITE };
+   unsigned int h = 2166136261u;                // FNV-1a
+   for (size_t c = 0; c < len; c++)
+   {
+      h = (h ^ (unsigned char)name[c]) * 16777619u;
+   }
 
-   int should_run = 1; /* flag to determine when to exit program */
-   int argSize = MAX_LINE / 2 + 1;
-   char *args[argSize]; /* command line arguments */
-   char history[MAX_LINE] = {'\0'};
+   Var *var = &vars[h & (numVarSlots - 1)];
+   while (var->text != NULL && (var->nameLen != len
+                                || memcmp(var->text, name, len) != 0))
+   {
+      var++;                                     // Linear probe with wrap
+      if (var == vars + numVarSlots)
+      {
+         var = vars;
+      }
+   }
+   return var;
+}
 
-   printf("Unix C Shell by Korosh Moosavi. Begin typing commands, or type \"exit\" to quit.\n");
 
-   while (should_run)
+/** ------------------------------- growVars ----------------------------------
+ * Moves the variables to a table twice the size, dropping the unset ones
+ *   nothing refers to any more
+ */
+static void growVars(void)
+{
+   Var *old = vars;
+   size_t oldSlots = numVarSlots;
+
+   numVarSlots = oldSlots > 0 ? oldSlots * 2 : 256;
+   vars = calloc(numVarSlots, sizeof(Var));
+   if (vars == NULL)
    {
-      char theCommand[MAX_LINE];          // The entered command
-      int numArgs = 0;                    // # arguments included
-      int bgProcess = 0;                  // Flag for &
+      perror("Out of memory");
+      exit(1);
+   }
+   numVarsUsed = 0;
+   for (size_t v = 0; v < oldSlots; v++)
+   {
+      if (old[v].flags != 0)
+      {
+         *findVar(old[v].text, old[v].nameLen) = old[v];
+         numVarsUsed++;
+      }
+      else
+      {
+         free(old[v].text);
+      }
+   }
+   free(old);
+}
+
+
+/** -------------------------------- getVar -----------------------------------
+ * Returns the value of the variable name, or NULL if it isn't set
+ */
+static const char *getVar(const char *name)
+{
+   const Var *var = findVar(name, strlen(name));
+
+   return var->flags & VAR_SET ? var->text + var->nameLen + 1 : NULL;
+}
+
 
-      printf("osh> ");                    // Print shell line starter
-      fflush(stdout);                     // Flush output
+/** -------------------------------- setVar -----------------------------------
+ * Sets the variable named by the first len characters of name to value,
+ *   keeping whether it's exported
+ */
+static void setVar(const char *name, size_t len, const char *value)
+{
+   if ((numVarsUsed + 1) * 2 > numVarSlots)
+   {
+      growVars();
+   }
 
-      fgets(theCommand, sizeof(theCommand), stdin);   // Get command
-      theCommand[strlen(theCommand) - 1] = '\0';      // Remove \n
+   Var *var = findVar(name, len);
+   size_t valueLen = strlen(value);
+   char *text = malloc(len + valueLen + 2);
+   if (text == NULL)
+   {
+      perror("Out of memory");
+      exit(1);
+   }
+   memcpy(text, name, len);
+   text[len] = '=';
+   memcpy(text + len + 1, value, valueLen + 1);
 
-      // Empty input
-      if (theCommand[0] == '\0') 
+   if (var->text == NULL)
+   {
+      numVarsUsed++;
+   }
+   else if (var->flags & VAR_IN_ENV)        // Freed once shellEnvp is rebuilt
+   {
+      char **grown = realloc(retired, (numRetired + 1) * sizeof(char *));
+      if (grown != NULL)                    // Otherwise it's leaked
       {
-         continue;
+         retired = grown;
+         retired[numRetired++] = var->text;
+      }
+   }
+   else
+   {
+      free(var->text);
+   }
+
+   var->text = text;
+   var->nameLen = len;
+   var->flags |= VAR_SET;
+   if (var->flags & VAR_EXPORTED)
+   {
+      envStale = 1;
+   }
+   if (len == 4 && memcmp(name, "PATH", 4) == 0)
+   {
+      pathVersion++;
+   }
+}
+
+
+/** ------------------------------ exportVar ----------------------------------
+ * Marks the variable name as exported, an unset one goes into the
+ *   environment once it's set
+ */
+static void exportVar(const char *name, size_t len)
+{
+   Var *var = findVar(name, len);
+
+   if (var->text == NULL)
+   {
+      setVar(name, len, "");
+      var = findVar(name, len);
+      var->flags &= ~VAR_SET;
+   }
+   if ((var->flags & (VAR_SET | VAR_EXPORTED)) == VAR_SET)
+   {
+      envStale = 1;
+   }
+   var->flags |= VAR_EXPORTED;
+}
+
+
+/** -------------------------------- unsetVar ---------------------------------
+ * Removes the variable name (its slot keeps the name for probing)
+ */
+static void unsetVar(const char *name)
+{
+   size_t len = strlen(name);
+   Var *var = findVar(name, len);
+
+   if (var->flags & VAR_SET && var->flags & VAR_EXPORTED)
+   {
+      envStale = 1;
+   }
+   if (var->flags & VAR_SET && len == 4 && memcmp(name, "PATH", 4) == 0)
+   {
+      pathVersion++;
+   }
+   var->flags &= VAR_IN_ENV;
+}
+
+
+/** ------------------------------- shellEnv ----------------------------------
+ * Returns the environment for the commands the shell starts, rebuilding it
+ *   only if an exported variable changed since the last time
+ * environ is pointed at it too, for execvp() and posix_spawnp()
+ */
+static char **shellEnv(void)
+{
+   if (!envStale)
+   {
+      return shellEnvp;
+   }
+
+   size_t count = 0;
+   for (size_t v = 0; v < numVarSlots; v++)
+   {
+      count += (vars[v].flags & (VAR_SET | VAR_EXPORTED))
+               == (VAR_SET | VAR_EXPORTED);
+   }
+   char **envp = malloc((count + 1) * sizeof(char *));
+   if (envp == NULL)
+   {
+      return shellEnvp;                 // Keep the old one
+   }
+   count = 0;
+   for (size_t v = 0; v < numVarSlots; v++)
+   {
+      vars[v].flags &= ~VAR_IN_ENV;
+      if ((vars[v].flags & (VAR_SET | VAR_EXPORTED))
+          == (VAR_SET | VAR_EXPORTED))
+      {
+         envp[count++] = vars[v].text;
+         vars[v].flags |= VAR_IN_ENV;
       }
+   }
+   envp[count] = NULL;
+
+   environ = envp;
+   free(shellEnvp);
+   shellEnvp = envp;
+   for (size_t r = 0; r < numRetired; r++)
+   {
+      free(retired[r]);
+   }
+   numRetired = 0;
+   envStale = 0;
+   return envp;
+}
 
-      // Check for exit
-      if (strcmp(theCommand, "exit") == 0)
+
+/** ------------------------------- initVars ----------------------------------
+ * Makes every variable of the environment the shell started with an
+ *   exported shell variable
+ */
+static void initVars(void)
+{
+   growVars();
+   for (char **env = environ; *env != NULL; env++)
+   {
+      const char *equals = strchr(*env, '=');
+      if (equals != NULL)
       {
-         should_run = 0;
-         continue;
+         setVar(*env, equals - *env, equals + 1);
+         exportVar(*env, equals - *env);
       }
+   }
+   shellEnv();
+}
 
-      // Check for history (!!)
-      if (strcmp(theCommand, "!!") == 0)  // History call
+
+/** ------------------------------ setAssigns ---------------------------------
+ * Sets the variables of a list of NAME=VALUE words, exporting them too if
+ *   exported (in a child about to run the command they came before)
+ */
+static void setAssigns(char **assigns, int exported)
+{
+   for (; *assigns != NULL; assigns++)
+   {
+      const char *equals = strchr(*assigns, '=');
+      setVar(*assigns, equals - *assigns, equals + 1);
+      if (exported)
       {
-         if (history[0] == '\0')          // No valid previous command
-         {
-            printf("No command in history.\n");
-            continue;
-         }
-         else                             // Reuse last command
-         {
-            strcpy(theCommand, history);  // Copy command from history
-            printf("Previous command: %s\n", theCommand);
-         }
+         exportVar(*assigns, equals - *assigns);
       }
-      
-      // New command
-      else 
+   }
+}
+
+
+/* Command hash, maps command names to where they were found on PATH
+ *   Open addressing with linear probing, an entry whose path is NULL was
+ *   invalidated and is looked up again on its next use */
+#define CMD_HASH_SIZE 1024    /* Must be a power of 2 */
+typedef struct
+{
+   char *name;
+   char *path;
+   int hits;
+} HashEntry;
+static HashEntry cmdHash[CMD_HASH_SIZE];
+static int cmdHashCount = 0;
+static unsigned long hashedVersion = 0;  // pathVersion it was filled at
+
+/* Set by a child whose cached path no longer exists, shared with the shell
+ *   so the next lookup can throw the stale table away */
+static volatile int *hashStale = NULL;
+
+
+/** ------------------------------ clearHash ----------------------------------
+ * Forgets every remembered command location (hash -r)
+ */
+static void clearHash(void)
+{
+   for (int h = 0; h < CMD_HASH_SIZE; h++)
+   {
+      free(cmdHash[h].name);
+      free(cmdHash[h].path);
+      cmdHash[h] = (HashEntry){ NULL, NULL, 0 };
+   }
+   cmdHashCount = 0;
+}
+
+
+/** ------------------------------ searchPath ---------------------------------
+ * Walks PATH for an executable called name
+ * Returns a malloc()ed absolute path or NULL if it isn't found
+ */
+static char *searchPath(const char *name, const char *pathVar)
+{
+   size_t nameLen = strlen(name);
+   const char *dir = pathVar;
+
+   while (*dir != '\0')
+   {
+      const char *end = strchr(dir, ':');
+      size_t dirLen = end != NULL ? (size_t)(end - dir) : strlen(dir);
+      char *full = malloc(dirLen + nameLen + 3);
+      struct stat info;
+
+      if (full == NULL)
       {
-         strcpy(history, theCommand);     // Copy command to history
+         perror("Out of memory");
+         exit(1);
       }
-      
-      // Check for background process (&)
-      bgProcess = theCommand[strlen(theCommand) - 1] == '&'; 
-      if (bgProcess)                      // Remove & from arguments
+      if (dirLen == 0)                         // Empty entry means .
       {
-         theCommand[strlen(theCommand) - 1] = '\0';
+         full[0] = '.';
+         dirLen = 1;
       }
+      else
+      {
+         memcpy(full, dir, dirLen);
+      }
+      full[dirLen] = '/';
+      memcpy(full + dirLen + 1, name, nameLen + 1);
 
-      // Tokenize arguments
-      args[numArgs] = strtok(theCommand, " ");
-      while (args[numArgs] != NULL)
+      if (stat(full, &info) == 0 && S_ISREG(info.st_mode)
+          && access(full, X_OK) == 0)
       {
-         numArgs++;                       // Save each token to its own index
-         args[numArgs] = strtok(NULL, " ");
+         return full;
       }
+      free(full);
 
-      // Find special case characters > < |
-      //  Only finds 1
-      //  If there are multiple only the first will be found
-      //    The rest are passed as arguments
-      int needPipe = 0;    // 0 = no pipe      1 = needs pipe
-      int ioRedirect = 0;  // 0 = no redirect  1 = input      2 = output
-      int i;               // Index of special case character, if found
-      for (i = 1; i <= numArgs - 1; i++)
+      if (end == NULL)
       {
-         if (strcmp(args[i], "<") == 0)      // Input redirect
-         {
-            ioRedirect = 1;
-            break;
-         }
-         else if (strcmp(args[i], ">") == 0) // Output redirect
-         {
-            ioRedirect = 2;
-            break;
-         }
-         else if (strcmp(args[i], "|") == 0) // Pipe needed
-         {
-            needPipe = 1;
-            break;
-         }
+         break;
       }
+      dir = end + 1;
+   }
+   return NULL;
+}
+
+
+/** ------------------------------- findEntry ---------------------------------
+ * Returns the hash slot for name, which is empty if name isn't in the table
+ */
+static HashEntry *findEntry(const char *name)
+{
+   unsigned int h = 2166136261u;                // FNV-1a
+   for (const char *c = name; *c != '\0'; c++)
+   {
+      h = (h ^ (unsigned char)*c) * 16777619u;
+   }
 
-      // Begin forking
-      int status = 0;
-      pid_t childPid= fork();
-      
-      if (childPid > 0)       // -------------------------------------- Parent
+   HashEntry *entry = &cmdHash[h & (CMD_HASH_SIZE - 1)];
+   while (entry->name != NULL && strcmp(entry->name, name) != 0)
+   {
+      entry++;                                   // Linear probe with wrap
+      if (entry == cmdHash + CMD_HASH_SIZE)
       {
-         if (bgProcess == 0)  // Parent waits if command didn't have an &
-         {
-            wait(&status);
-         }
+         entry = cmdHash;
       }
-      
-      else if (childPid == 0) // -------------------------------------- Child
-      { 
-         // Pipe between child and grandchild
-         if (needPipe) 
-         {
-            int fd1[2];
-            int status2;
+   }
+   return entry;
+}
 
-            if (pipe(fd1) == -1)                      // Make a pipe
-            {
-               perror("Pipe failed");
-               exit(1);
-            }
 
-            // Split command into its sub-commands
-            char *firstCommand[i + 1];                // First process
-            char *secondCommand[numArgs - i];         // Second process
+/** ----------------------------- lookupCommand -------------------------------
+ * Returns where the command lives, walking PATH only the first time a name
+ *   is used (or after PATH changes or an entry turns out to be stale)
+ * Returns NULL for names containing a / and for commands that aren't found,
+ *   those are left for execvp() to report
+ */
+static const char *lookupCommand(const char *name)
+{
+   const char *pathVar = getVar("PATH");
 
-            for (int j = 0; j < i; j++)               // Copy first command
-            {
-               firstCommand[j] = args[j];
-            }
-            firstCommand[i] = NULL;                   // Set null terminator
+   if (strchr(name, '/') != NULL || pathVar == NULL)
+   {
+      return NULL;
+   }
 
-            for (int j = 0; j < numArgs - i - 1; j++) // Copy second command
-            {
-               secondCommand[j] = args[j + i + 1];
-            }
-            secondCommand[numArgs - i - 1] = NULL;    // Set null termintator
+   if (hashStale == NULL)                       // Page shared with children
+   {
+      void *page = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+      hashStale = page != MAP_FAILED ? page : calloc(1, sizeof(int));
+   }
 
-            
-            // Fork and execute commands separately
-            int gChildPid = fork(); 
-            
-            if (gChildPid > 0)      // --------------------------- Child
-            {
-               wait(&status2);      // Child waits for grandchild
-               dup2(fd1[READ], STDIN_FILENO);
-               close(fd1[READ]);    // then executes command + reads from pipe
-               close(fd1[WRITE]);
+   // Start over if PATH changed, a child hit a missing file, or it's full
+   if (*hashStale || hashedVersion != pathVersion
+       || cmdHashCount >= CMD_HASH_SIZE * 3 / 4)
+   {
+      clearHash();
+      hashedVersion = pathVersion;
+      *hashStale = 0;
+   }
 
-               if (execvp(secondCommand[0], secondCommand) == -1)
-               {
-                  perror("Exec failed");
-                  exit(1);
-               }
-            }
+   HashEntry *entry = findEntry(name);
+   if (entry->name == NULL)                      // First use of this name
+   {
+      entry->name = strdup(name);
+      cmdHashCount++;
+   }
+   if (entry->path == NULL)                      // New or invalidated
+   {
+      entry->path = searchPath(name, pathVar);
+      if (entry->path == NULL)
+      {
+         return NULL;
+      }
+   }
 
-            else if (gChildPid == 0)// --------------------------- Grandchild
-            {
-               dup2(fd1[WRITE], STDOUT_FILENO);
-               close(fd1[WRITE]);   // Grandchild begins execution of first
-               close(fd1[READ]);    //   command and writes output to pipe
+   entry->hits++;
+   return entry->path;
+}
 
-               if (execvp(firstCommand[0], firstCommand) == -1)
-               {
-                  perror("Exec failed");
-                  exit(1);
-               }
-               exit(1);
-            }
 
-            else                    // gChildPid < 0
-            {
-               perror("Child fork failed");
-            }
+/** ------------------------------ forgetCommand ------------------------------
+ * Invalidates the cached path for name after exec reported it missing
+ */
+static void forgetCommand(const char *name)
+{
+   HashEntry *entry = findEntry(name);
+
+   free(entry->path);
+   entry->path = NULL;
+}
+
+
+/** ------------------------------ builtinHash --------------------------------
+ * hash           prints the remembered commands and how often each was used
+ * hash -r        forgets every remembered command
+ * hash NAME...   looks up and remembers each NAME
+ */
+static int builtinHash(char **args)
+{
+   if (args[1] == NULL)
+   {
+      if (cmdHashCount == 0)
+      {
+         printf("hash: hash table empty\n");
+         return 0;
+      }
+      printf("hits\tcommand\n");
+      for (int h = 0; h < CMD_HASH_SIZE; h++)
+      {
+         if (cmdHash[h].path != NULL)
+         {
+            printf("%4d\t%s\n", cmdHash[h].hits, cmdHash[h].path);
          }
+      }
+      return 0;
+   }
 
-         // No pipe needed
-         else {
-            int fd2;
-            // Input redirect
-            if (ioRedirect == 1)
-            {
-               // Open file input
-               fd2 = open(args[i + 1], O_RDONLY, 0666);
-               if (fd2 == -1 || args[i + 1] == NULL)
-               {
-                  perror("Input file failed");
-                  exit(1);
-               }
+   if (strcmp(args[1], "-r") == 0)
+   {
+      clearHash();
+      return 0;
+   }
 
-               args[i] = NULL;      // Remove <
-               args[i + 1] = NULL;  // Remove input file name
-               dup2(fd2, STDIN_FILENO);
-            }
+   int status = 0;
+   for (int a = 1; args[a] != NULL; a++)
+   {
+      if (strchr(args[a], '/') != NULL)         // Not searched for
+      {
+         continue;
+      }
 
-            // Output redirect
-            else if (ioRedirect == 2)
-            {
-               // Open file output
-               // This will clear any contents inside the file before outputting
-               fd2 = open(args[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0666);
-               if (fd2 == -1 || args[i + 1] == NULL)
-               {
-                  perror("Output file failed");
-                  exit(1);
-               }
+      forgetCommand(args[a]);                   // Search PATH again
+      if (lookupCommand(args[a]) == NULL)
+      {
+         fprintf(stderr, "hash: %s: not found\n", args[a]);
+         status = 1;
+         continue;
+      }
+      findEntry(args[a])->hits = 0;             // Not a use of the command
+   }
+   return status;
+}
 
-               args[i] = NULL;      // Remove >
-               args[i + 1] = NULL;  // Remove output file name
-               dup2(fd2, STDOUT_FILENO);
-            }
 
-            // Execute command
-            if (execvp(args[0], args) == -1)
-            {
-               perror("Exec failed");
-               exit(1);
-            }
+/* Per-command bump allocator, holds the tokens, argument lists and stages
+ *   of one command and is emptied in one go once the command is done */
+typedef struct ArenaBlock
+{
+   struct ArenaBlock *next;   // Older, fuller block
+   size_t size;               // Bytes in data
+   size_t used;
+   char data[];
+} ArenaBlock;
+typedef struct
+{
+   ArenaBlock *head;          // Block being allocated from
+} Arena;
 
-            switch(ioRedirect){
-               case 1 :             // Input was redirected
-                  close(STDIN_FILENO);
-                  break;
-               
-               case 2 :             // Output was redirected
-                  close(STDOUT_FILENO);
-                  break;
-            }
-            close(fd2);             // Close file
-         }
+
+/** ------------------------------ arenaAlloc ---------------------------------
+ * Returns size bytes (aligned for any type) that stay valid until the
+ *   next arenaReset()
+ */
+static void *arenaAlloc(Arena *arena, size_t size)
+{
+   size = (size + 15) & ~(size_t)15;
+   ArenaBlock *block = arena->head;
+
+   if (block == NULL || block->size - block->used < size)
+   {
+      size_t blockSize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+      if (block != NULL && block->size * 2 > blockSize)
+      {
+         blockSize = block->size * 2;          // Grow geometrically
       }
 
-      else
+      block = malloc(sizeof(ArenaBlock) + blockSize);
+      if (block == NULL)
       {
-         perror("Fork failed");     // childPid < 0
+         perror("Out of memory");
+         exit(1);
       }
+      block->next = arena->head;
+      block->size = blockSize;
+      block->used = 0;
+      arena->head = block;
+   }
+
+   void *mem = block->data + block->used;
+   block->used += size;
+   return mem;
+}
+
+
+/** ------------------------------ arenaStrdup --------------------------------
+ * Copies the first len characters of text into the arena, NUL terminated
+ */
+static char *arenaStrndup(Arena *arena, const char *text, size_t len)
+{
+   char *copy = arenaAlloc(arena, len + 1);
+   memcpy(copy, text, len);
+   copy[len] = '\0';
+   return copy;
+}
+
+
+/** ------------------------------ arenaReset ---------------------------------
+ * Frees everything allocated from the arena at once
+ * A command that needed several blocks leaves behind one block big enough
+ *   for all of it, so the next command like it needs no malloc() at all
+ */
+static void arenaReset(Arena *arena)
+{
+   ArenaBlock *block = arena->head;
+
+   if (block == NULL)
+   {
+      return;
+   }
+   if (block->next == NULL)                    // The common case
+   {
+      block->used = 0;
+      return;
+   }
+
+   size_t total = 0;
+   while (block != NULL)
+   {
+      ArenaBlock *next = block->next;
+      total += block->size;
+      free(block);
+      block = next;
+   }
+   arena->head = NULL;
+   arenaAlloc(arena, total);
+   arena->head->used = 0;
+}
+
+
+/** ------------------------------- arenaFree ---------------------------------
+ * Gives every block of the arena back to malloc(), for an arena that isn't
+ *   used again
+ */
+static void arenaFree(Arena *arena)
+{
+   while (arena->head != NULL)
+   {
+      ArenaBlock *next = arena->head->next;
+      free(arena->head);
+      arena->head = next;
+   }
+}
+
+
+/** ------------------------------ validName ----------------------------------
+ * Whether the first len characters of name are a variable name
+ */
+static int validName(const char *name, size_t len)
+{
+   if (len == 0 || (name[0] >= '0' && name[0] <= '9'))
+   {
+      return 0;
+   }
+   for (size_t c = 0; c < len; c++)
+   {
+      if (!(name[c] == '_' || (name[c] >= 'a' && name[c] <= 'z')
+            || (name[c] >= 'A' && name[c] <= 'Z')
+            || (name[c] >= '0' && name[c] <= '9')))
+      {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+
+/* Marks a $ reference lexLine() found in a word, in place of the $, the
+ *   reference itself follows as it was typed */
+#define EXPAND_PLAIN '\001'     /* Outside quotes, its value is split */
+#define EXPAND_QUOTED '\002'    /* Inside "...", its value stays one word */
+#define SUBST_PLAIN '\004'      /* $(...) or `...`, the command follows */
+#define SUBST_QUOTED '\005'     /* The same inside "..." */
+#define SUBST_END '\006'        /* Ends the command after either */
+#define EXPAND_MARKS "\001\002\004\005"
+#define SUBST_MARKS "\004\005"
+
+
+/** ------------------------------ varRefLength -------------------------------
+ * Length of the variable reference at ref (just after a $): NAME, {...}
+ *   or one of ? ! and $
+ * Returns 0 if there's none, that $ is then just a $
+ */
+static size_t varRefLength(const char *ref)
+{
+   size_t len = 0;
+
+   if (ref[0] == '{')                     // Up to the matching }
+   {
+      int depth = 0;
+      do
+      {
+         depth += (ref[len] == '{') - (ref[len] == '}');
+         len++;
+      } while (depth > 0 && ref[len] != '\0');
+      return depth == 0 ? len : 0;
+   }
+   if (ref[0] == '?' || ref[0] == '!' || ref[0] == '$')
+   {
+      return 1;
+   }
+   while (validName(ref, len + 1))
+   {
+      len++;
+   }
+   return len;
+}
+
+
+/** ------------------------------ substLength --------------------------------
+ * Length of the $(...) or `...` starting at at, up to its matching ) (with
+ *   quotes and nested parentheses skipped) or its closing `
+ * Returns 0 if the line ends before it does
+ */
+static size_t substLength(const char *at)
+{
+   int depth = 0;
+   char quote = '\0';
+
+   for (size_t len = 1; at[len] != '\0'; len++)
+   {
+      char c = at[len];
+      if (c == '\\' && at[len + 1] != '\0' && quote != '\'')
+      {
+         len++;
+      }
+      else if (at[0] == '`')
+      {
+         if (c == '`')
+         {
+            return len + 1;
+         }
+      }
+      else if (quote != '\0')
+      {
+         quote = c == quote ? '\0' : quote;
+      }
+      else if (c == '\'' || c == '"')
+      {
+         quote = c;
+      }
+      else if (c == '(')
+      {
+         depth++;
+      }
+      else if (c == ')' && --depth == 0)
+      {
+         return len + 1;
+      }
+   }
+   return 0;
+}
+
+
+/* Token kinds produced by lexLine() */
+enum
+{
+   TOK_WORD,
+   TOK_PIPE,                  // |
+   TOK_IN,                    // [n]<
+   TOK_OUT,                   // [n]>
+   TOK_APPEND,                // [n]>>
+   TOK_DUP,                   // [n]>& or [n]<&, the next word is the source
+   TOK_BOTH,                  // &>   stdout and stderr to a file
+   TOK_BOTH_APPEND,           // &>>
+   TOK_BG,                    // &
+   TOK_AND,                   // &&
+   TOK_OR,                    // ||
+   TOK_SEMI,                  // ;
+   TOK_NEWLINE                // Lines of one command are joined by \n
+};
+typedef struct
+{
+   int type;                  // TOK_WORD or one of the operators
+   int fd;                    // Descriptor a redirect applies to
+   char *text;                // Unquoted text of a TOK_WORD, else NULL
+   int plain;                 // A word without quotes or escapes, only
+                              //   those can be keywords like if or done
+   int start;                 // Where it was in the line, as offsets
+   int end;
+} Token;
+
+
+/** ------------------------------- isOperator --------------------------------
+ * Whether c starts an operator, which also ends any word before it
+ */
+static int isOperator(char c)
+{
+   return c == '|' || c == '<' || c == '>' || c == '&' || c == ';'
+          || c == '\n';
+}
+
+
+/** -------------------------------- lexLine ----------------------------------
+ * Splits text into tokens in a single pass, words are unquoted in place
+ *   (text is overwritten) and the token array comes from arena
+ * Words are separated by spaces or tabs, or end at an operator, so ls|wc
+ *   and cmd>out work without spaces
+ * Operators are | & < > >> >& <& &> &>> && || ; and newline, and unquoted
+ *   digits right before a redirect (2>err) become its descriptor
+ * Inside '...' everything is literal, inside "..." a backslash only escapes
+ *   " \ $ ` and newline, and outside quotes a backslash escapes any
+ *   character, a backslash and newline just join the two lines
+ * A $NAME ${...} $? $! or $$ outside '...' is left for expandText(), its
+ *   $ replaced by EXPAND_PLAIN or EXPAND_QUOTED, and a $(...) or `...`
+ *   becomes SUBST_PLAIN or SUBST_QUOTED, the command and SUBST_END
+ * A # at the start of a word comments out the rest of the line
+ * Returns the number of tokens, or -2 if text ends inside quotes or right
+ *   after a backslash, so the command goes on over the next line
+ */
+static int lexLine(Arena *arena, char *text, Token **tokensOut)
+{
+   size_t len = strlen(text);
+   Token *tokens = arenaAlloc(arena, (len + 1) * sizeof(Token));
+   int numTokens = 0;
+   char *in = text;
+   char c = *in;              // Current character, kept here because ending
+                              //   a word can overwrite it with a NUL
+   char *wordEnd = NULL;      // Where the last word stopped
+   int wordPlain = 0;         // Whether it had no quotes or escapes
+   for (;;)
+   {
+      while (c == ' ' || c == '\t' || (c == '\\' && in[1] == '\n'))
+      {
+         in += c == '\\' ? 2 : 1;
+         c = *in;
+      }
+      if (c == '#')                              // Up to the newline
+      {
+         while (c != '\0' && c != '\n')
+         {
+            c = *++in;
+         }
+      }
+      if (c == '\0')
+      {
+         break;
+      }
+      if (c == '\\' && in[1] == '\0')
+      {
+         return -2;
+      }
+
+      if (isOperator(c))
+      {
+         char next = in[1];   // Only in[0] can have been overwritten
+         int opLen = 1;
+         int type = TOK_BG;
+         int fd = c == '<' ? STDIN_FILENO : STDOUT_FILENO;
+         int start = in - text;
+
+         // Digits right before a redirect name its descriptor, as in 2>
+         if ((c == '<' || c == '>') && in == wordEnd && wordPlain
+             && strspn(tokens[numTokens - 1].text, "0123456789")
+                == strlen(tokens[numTokens - 1].text))
+         {
+            start = tokens[--numTokens].start;
+            fd = atoi(tokens[numTokens].text);
+         }
+
+         if (c == '|')
+         {
+            type = next == '|' ? TOK_OR : TOK_PIPE;
+            opLen = next == '|' ? 2 : 1;
+         }
+         else if (c == ';' || c == '\n')
+         {
+            type = c == ';' ? TOK_SEMI : TOK_NEWLINE;
+         }
+         else if (c == '<')
+         {
+            type = next == '&' ? TOK_DUP : TOK_IN;
+            opLen = next == '&' ? 2 : 1;
+         }
+         else if (c == '>')
+         {
+            type = next == '>' ? TOK_APPEND : next == '&' ? TOK_DUP : TOK_OUT;
+            opLen = type == TOK_OUT ? 1 : 2;
+         }
+         else if (next == '>')                   // &> or &>>
+         {
+            type = in[2] == '>' ? TOK_BOTH_APPEND : TOK_BOTH;
+            opLen = type == TOK_BOTH ? 2 : 3;
+         }
+         else if (next == '&')
+         {
+            type = TOK_AND;
+            opLen = 2;
+         }
+
+         in += opLen;
+         tokens[numTokens++] = (Token){ type, fd, NULL, 0, start, in - text };
+         c = *in;
+         continue;
+      }
+
+      // Word, unquoted characters are copied down to out
+      char *out = in;
+      char quote = '\0';
+      size_t refLen;
+      wordPlain = 1;
+      Token *word = &tokens[numTokens++];
+      *word = (Token){ TOK_WORD, -1, out, 0, in - text, 0 };
+      for (;;)
+      {
+         if (c == '\0')
+         {
+            break;
+         }
+         else if ((c == '`' || (c == '$' && in[1] == '('))
+                  && quote != '\'')
+         {
+            size_t substLen = substLength(in);
+            if (substLen == 0)
+            {
+               return -2;                        // Goes on on the next line
+            }
+            char *end = in + substLen - 1;
+            *out++ = quote == '"' ? SUBST_QUOTED : SUBST_PLAIN;
+            for (in += c == '`' ? 1 : 2; in < end; in++)
+            {
+               if (c == '`' && in[0] == '\\' && strchr("\\`$", in[1]))
+               {
+                  in++;                          // \` inside `...`
+               }
+               *out++ = *in;
+            }
+            *out++ = SUBST_END;
+            wordPlain = 0;
+         }
+         else if (c == '$' && quote != '\''
+                  && (refLen = varRefLength(in + 1)) > 0)
+         {
+            *out++ = quote == '"' ? EXPAND_QUOTED : EXPAND_PLAIN;
+            memmove(out, in + 1, refLen);        // Kept as typed
+            out += refLen;
+            in += refLen;
+            wordPlain = 0;
+         }
+         else if (quote == '\'')                 // Literal until '
+         {
+            if (c == '\'')
+            {
+               quote = '\0';
+            }
+            else
+            {
+               *out++ = c;
+            }
+         }
+         else if (quote == '"')                  // Some escapes until "
+         {
+            if (c == '"')
+            {
+               quote = '\0';
+            }
+            else if (c == '\\' && in[1] == '\n')
+            {
+               in++;
+            }
+            else
+            {
+               if (c == '\\' && in[1] != '\0' && strchr("\"\\$`", in[1]))
+               {
+                  c = *++in;
+               }
+               *out++ = c;
+            }
+         }
+         else if (c == '\'' || c == '"')
+         {
+            quote = c;
+            wordPlain = 0;
+         }
+         else if (c == '\\')                     // Escapes anything
+         {
+            wordPlain = 0;
+            if (in[1] == '\0')
+            {
+               return -2;
+            }
+            c = *++in;
+            if (c != '\n')
+            {
+               *out++ = c;
+            }
+         }
+         else if (c == ' ' || c == '\t' || isOperator(c))
+         {
+            break;
+         }
+         else
+         {
+            *out++ = c;
+         }
+         c = *++in;
+      }
+
+      if (quote != '\0')
+      {
+         return -2;
+      }
+      c = *in;
+      wordEnd = in;
+      word->plain = wordPlain;
+      word->end = in - text;
+      *out = '\0';            // Safe, c holds the delimiter this may cover
+   }
+
+   *tokensOut = tokens;
+   return numTokens;
+}
+
+
+/* Set once a child changed state, background children are reaped before
+ *   the next prompt or as soon as the shell waits for anything */
+static volatile sig_atomic_t childExited = 0;
+
+/* Tracing (OSH_TRACE=FILE or set trace=FILE): timestamps of the phases a
+ *   command goes through, kept in a ring in memory and written out when it
+ *   fills and after every command line, as Chrome trace JSON for a FILE
+ *   ending in .json and as fixed size records otherwise
+ * A child only writes the one event it has, with a single write() to the
+ *   O_APPEND file, so nothing is shared between processes; the ring has a
+ *   single writer and needs no lock */
+enum
+{
+   TRACE_READ, TRACE_LEX, TRACE_PARSE, TRACE_PATH, TRACE_FORK, TRACE_EXEC,
+   TRACE_WAIT
+};
+static const char *traceNames[] =
+{
+   "read", "lex", "parse", "path", "fork", "exec", "wait"
+};
+#define TRACE_RING 1024    /* Events, a power of 2 */
+#define TRACE_NAME 16      /* Bytes of the command name kept */
+typedef struct
+{
+   uint64_t start;         // CLOCK_MONOTONIC ns
+   uint64_t end;           // Same as start for an instant event
+   int32_t pid;
+   int32_t kind;           // TRACE_ code
+   char name[TRACE_NAME];  // Command it was about, NUL padded
+} TraceEvent;              // Also the binary format's record
+static TraceEvent traceRing[TRACE_RING];
+static unsigned long traceHead = 0;     // Events ever recorded
+static unsigned long traceFlushed = 0;  // Of those, written out
+static int traceFd = -1;
+static int traceJson = 0;
+static pid_t traceOwner = 0;            // Closes the JSON array at exit
+
+
+/** ------------------------------- traceNow ----------------------------------
+ * Monotonic clock in nanoseconds, 0 when not tracing so a disabled trace
+ *   point costs only the test
+ */
+static uint64_t traceNow(void)
+{
+   struct timespec now;
+
+   if (traceFd == -1)
+   {
+      return 0;
+   }
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+
+/** ----------------------------- appendNumber --------------------------------
+ * Writes n in decimal at out, with a . before its last point digits if
+ *   point isn't 0
+ * Returns the end of what it wrote; only touches memory, so it is safe in
+ *   a vfork() child
+ */
+static char *appendNumber(char *out, uint64_t n, int point)
+{
+   char digits[24];
+   int len = 0;
+
+   do
+   {
+      digits[len++] = '0' + n % 10;
+      n /= 10;
+   } while (n > 0 || len <= point);
+   while (len > 0)
+   {
+      if (len-- == point && point > 0)
+      {
+         *out++ = '.';
+      }
+      *out++ = digits[len];
+   }
+   return out;
+}
+
+
+/** ------------------------------ formatEvent --------------------------------
+ * Puts one event at out the way the trace file wants it
+ * Returns its length, at most 160 bytes
+ */
+static size_t formatEvent(char *out, const TraceEvent *ev)
+{
+   if (!traceJson)
+   {
+      memcpy(out, ev, sizeof(*ev));
+      return sizeof(*ev);
+   }
+
+   char *at = out;
+   at = stpcpy(at, "{\"name\":\"");
+   at = stpcpy(at, traceNames[ev->kind]);
+   for (int c = 0; c < TRACE_NAME && ev->name[c] != '\0'; c++)
+   {
+      if (c == 0)
+      {
+         *at++ = ' ';
+      }
+      char ch = ev->name[c];
+      *at++ = ch == '"' || ch == '\\' || (unsigned char)ch < ' ' ? '?' : ch;
+   }
+   at = stpcpy(at, ev->start == ev->end ? "\",\"ph\":\"i\",\"s\":\"t\""
+                                        : "\",\"ph\":\"X\"");
+   at = stpcpy(at, ",\"ts\":");
+   at = appendNumber(at, ev->start, 3);                  // Microseconds
+   if (ev->start != ev->end)
+   {
+      at = stpcpy(at, ",\"dur\":");
+      at = appendNumber(at, ev->end - ev->start, 3);
+   }
+   at = stpcpy(at, ",\"pid\":");
+   at = appendNumber(at, (uint64_t)ev->pid, 0);
+   at = stpcpy(at, ",\"tid\":");
+   at = appendNumber(at, (uint64_t)ev->pid, 0);
+   at = stpcpy(at, "},\n");
+   return at - out;
+}
+
+
+/** ------------------------------- traceFlush --------------------------------
+ * Writes out every event of the ring not written yet
+ */
+static void traceFlush(void)
+{
+   char buf[64 * 160];
+   size_t len = 0;
+
+   for (; traceFd != -1 && traceFlushed < traceHead; traceFlushed++)
+   {
+      len += formatEvent(buf + len,
+                         &traceRing[traceFlushed & (TRACE_RING - 1)]);
+      if (len > sizeof(buf) - 160 || traceFlushed + 1 == traceHead)
+      {
+         write(traceFd, buf, len);
+         len = 0;
+      }
+   }
+}
+
+
+/** ------------------------------- traceEvent --------------------------------
+ * Records that a kind phase about name (or NULL) ran from start until now,
+ *   start having come from traceNow()
+ */
+static void traceEvent(int kind, const char *name, uint64_t start)
+{
+   if (traceFd == -1)
+   {
+      return;
+   }
+   if (traceHead - traceFlushed == TRACE_RING)
+   {
+      traceFlush();
+   }
+
+   TraceEvent *ev = &traceRing[traceHead++ & (TRACE_RING - 1)];
+   ev->start = start;
+   ev->end = traceNow();
+   ev->pid = getpid();
+   ev->kind = kind;
+   memset(ev->name, 0, TRACE_NAME);
+   if (name != NULL)
+   {
+      strncpy(ev->name, name, TRACE_NAME - 1);
+   }
+}
+
+
+/** ------------------------------- traceChild --------------------------------
+ * Writes an instant event straight to the trace file from a child about to
+ *   exec, without the ring: nothing but the stack, write() and the clock,
+ *   so it's safe in a vfork() child too
+ */
+static void traceChild(int kind, const char *name)
+{
+   if (traceFd == -1)
+   {
+      return;
+   }
+
+   TraceEvent ev;
+   char buf[160];
+   memset(&ev, 0, sizeof(ev));
+   ev.start = ev.end = traceNow();
+   ev.pid = getpid();
+   ev.kind = kind;
+   for (int c = 0; c < TRACE_NAME - 1 && name[c] != '\0'; c++)
+   {
+      ev.name[c] = name[c];
+   }
+   write(traceFd, buf, formatEvent(buf, &ev));
+}
+
+
+/** ------------------------------- traceFork ---------------------------------
+ * In a forked copy of the shell: forgets the parent's events, which the
+ *   parent writes out itself
+ */
+static void traceFork(void)
+{
+   traceFlushed = traceHead;
+}
+
+
+/** ------------------------------- traceOpen ---------------------------------
+ * Starts tracing to file (emptied first), or stops for "off"
+ * Returns 0, or -1 (after printing why) if the file can't be opened
+ */
+static int traceOpen(const char *file)
+{
+   if (traceFd != -1)
+   {
+      traceFlush();
+      if (traceJson && getpid() == traceOwner)
+      {
+         write(traceFd, "{}]\n", 4);
+      }
+      close(traceFd);
+      traceFd = -1;
+   }
+   if (strcmp(file, "off") == 0)
+   {
+      return 0;
+   }
+
+   traceFd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                  0644);
+   if (traceFd == -1)
+   {
+      fprintf(stderr, "trace: %s: %s\n", file, strerror(errno));
+      return -1;
+   }
+   size_t len = strlen(file);
+   traceJson = len >= 5 && strcmp(file + len - 5, ".json") == 0;
+   traceOwner = getpid();
+   if (traceJson)
+   {
+      write(traceFd, "[\n", 2);
+   }
+   return 0;
+}
+
+
+/* Set by ^C in an interactive shell, or when it killed a foreground job,
+ *   stops whatever list or loop is running */
+static volatile sig_atomic_t interrupted = 0;
+
+
+/** ------------------------------- onSigint ----------------------------------
+ * SIGINT handler of an interactive shell, which only gets ^C itself while
+ *   running builtins, otherwise its job does
+ */
+static void onSigint(int sig)
+{
+   (void)sig;
+   interrupted = 1;
+   write(STDOUT_FILENO, "\n", 1);            // Past the ^C
+}
+
+
+/* Job table, one entry per background (or stopped) pipeline */
+#define MAX_JOBS 256
+enum { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+typedef struct
+{
+   pid_t pid;
+   int state;              // JOB_RUNNING, JOB_STOPPED or JOB_DONE
+   int status;             // Last wait status
+   struct rusage usage;    // From wait4() once it's done
+   char *argv;             // Its words for the accounting log, or NULL
+} JobProc;
+typedef struct
+{
+   pid_t pgid;             // Process group of the job, 0 = free slot
+   JobProc *procs;         // One per pipeline stage
+   int numProcs;
+   int state;              // Summary of the procs' states
+   int notify;             // State changed since the user last saw it
+   unsigned long seq;      // Higher is more recent, picks the current job
+   char *command;          // Text the job was started from
+   double started;         // nowUsec() when it was launched
+   char *cgroup;           // Its cgroup, removed with it, or NULL
+} Job;
+static Job jobs[MAX_JOBS];    // Job %n lives in jobs[n - 1]
+static unsigned long jobSeq = 0;
+
+/* Set when commands come from a terminal, only then does the shell print
+ *   its banner, prompts and job notifications */
+static int interactive = 0;
+
+/* Whether a terminal gets the line editor, set edit=off reads plain lines */
+static int editing = 1;
+
+/* osh --minimal: no banner, history file or line editor, and stdout left
+ *   unbuffered so prompts and output go straight out with write() */
+static int minimal = 0;
+
+/* Job control, interactive shells only: every pipeline gets a process
+ *   group of its own and a foreground one is handed the terminal, which
+ *   goes back to the shell's group (and modes) once it exits or stops */
+static pid_t shellPgid = 0;
+static struct termios shellModes;
+static int foregroundLaunch = 0;   // Set while a foreground job is started
+static pid_t foregroundPgid = 0;   // Group of the one being waited for
+static int ownGroup = 0;           // Set by timeout: the next pipeline gets
+                                   //   a group even in a script
+
+/* Keyboard and terminal signals the interactive shell ignores, its children
+ *   get the default action back */
+static const int jobSignals[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+#define NUM_JOB_SIGNALS (int)(sizeof(jobSignals) / sizeof(jobSignals[0]))
+
+/* Set by the exit builtin */
+static int exitRequested = 0;
+
+/* Last stage of the last pipeline run with &, for $! */
+static pid_t lastBgPid = 0;
+
+/* Accounting log (set acctlog=FILE or OSH_ACCTLOG), one line per finished
+ *   child: pid, exit code, wall, user and sys msec, max RSS KiB and argv,
+ *   separated by tabs */
+static int acctFd = -1;
+
+/* Resources used by the last foreground pipeline, for time */
+static struct rusage pipelineUsage;
+
+
+/** -------------------------------- nowUsec ----------------------------------
+ * Monotonic clock in microseconds
+ */
+static double nowUsec(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+
+/* Event loop: one epoll instance the shell blocks in whenever it waits,
+ *   on a typed line, a foreground job or a timer
+ * SIGCHLD is kept blocked and read from a signalfd instead of a handler,
+ *   and every timer shares one timerfd armed for the earliest of them */
+enum { EVENT_INPUT = 1, EVENT_CHILD = 2, EVENT_TIMER = 4 };
+static int eventFd = -1;
+static int childFd = -1;           // signalfd for SIGCHLD
+static int timerFd = -1;
+static sigset_t childMask;         // Signal mask commands start with
+
+#define MAX_TIMERS 16
+typedef struct
+{
+   double due;             // nowUsec() to fire at, 0 = free slot
+   void (*fire)(void *arg);
+   void *arg;
+} Timer;
+static Timer timers[MAX_TIMERS];
+
+
+/** ------------------------------ initEvents ---------------------------------
+ * Blocks SIGCHLD and makes the epoll instance with the signalfd and the
+ *   timerfd in it, starting over with no timers if there was one already
+ *   (in a forked copy of the shell, which mustn't share the parent's)
+ * Returns 0, or -1 if any of them couldn't be made
+ */
+static int initEvents(void)
+{
+   sigset_t block;
+   sigemptyset(&block);
+   sigaddset(&block, SIGCHLD);
+
+   if (eventFd != -1)
+   {
+      close(eventFd);
+      close(childFd);
+      close(timerFd);
+      sigprocmask(SIG_BLOCK, &block, NULL);    // childMask stays the first
+   }
+   else
+   {
+      sigprocmask(SIG_BLOCK, &block, &childMask);
+   }
+   memset(timers, 0, sizeof(timers));
+
+   eventFd = epoll_create1(EPOLL_CLOEXEC);
+   childFd = signalfd(-1, &block, SFD_NONBLOCK | SFD_CLOEXEC);
+   timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if (eventFd == -1 || childFd == -1 || timerFd == -1)
+   {
+      return -1;
+   }
+
+   struct epoll_event child = { .events = EPOLLIN, .data.fd = childFd };
+   struct epoll_event timer = { .events = EPOLLIN, .data.fd = timerFd };
+   if (epoll_ctl(eventFd, EPOLL_CTL_ADD, childFd, &child) == -1
+       || epoll_ctl(eventFd, EPOLL_CTL_ADD, timerFd, &timer) == -1)
+   {
+      return -1;
+   }
+   return 0;
+}
+
+
+/** ------------------------------- armTimers ---------------------------------
+ * Sets the timerfd to go off when the earliest timer is due, or disarms it
+ *   if there's none left
+ */
+static void armTimers(void)
+{
+   double due = 0;
+   struct itimerspec when;
+
+   for (int t = 0; t < MAX_TIMERS; t++)
+   {
+      if (timers[t].due != 0 && (due == 0 || timers[t].due < due))
+      {
+         due = timers[t].due;
+      }
+   }
+   memset(&when, 0, sizeof(when));
+   when.it_value.tv_sec = (time_t)(due / 1e6);
+   when.it_value.tv_nsec = (long)((due - when.it_value.tv_sec * 1e6) * 1e3);
+   if (due != 0 && when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0)
+   {
+      when.it_value.tv_nsec = 1;               // 0 would disarm it
+   }
+   timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+
+/** ------------------------------- addTimer ----------------------------------
+ * Has fire(arg) called from the event loop usec microseconds from now
+ * Returns the timer for cancelTimer(), or -1 if every slot is taken
+ */
+static int addTimer(double usec, void (*fire)(void *arg), void *arg)
+{
+   for (int t = 0; t < MAX_TIMERS; t++)
+   {
+      if (timers[t].due == 0)
+      {
+         timers[t] = (Timer){ nowUsec() + usec, fire, arg };
+         armTimers();
+         return t;
+      }
+   }
+   fprintf(stderr, "Too many timers\n");
+   return -1;
+}
+
+
+/** ------------------------------ cancelTimer --------------------------------
+ * Drops a timer that hasn't fired yet, -1 is ignored
+ */
+static void cancelTimer(int timer)
+{
+   if (timer != -1 && timers[timer].due != 0)
+   {
+      timers[timer].due = 0;
+      armTimers();
+   }
+}
+
+
+/** ------------------------------- fireTimers --------------------------------
+ * Calls every timer that's due, each one only once
+ */
+static void fireTimers(void)
+{
+   uint64_t expirations;
+   double now = nowUsec();
+
+   while (read(timerFd, &expirations, sizeof(expirations)) > 0)
+   {
+   }
+   for (int t = 0; t < MAX_TIMERS; t++)
+   {
+      if (timers[t].due != 0 && timers[t].due <= now)
+      {
+         timers[t].due = 0;                    // It may add another
+         timers[t].fire(timers[t].arg);
+      }
+   }
+   armTimers();
+}
+
+
+/** ------------------------------- waitEvent ---------------------------------
+ * Blocks until a child changes state, a timer fires or inputFd (unless -1)
+ *   can be read, firing the timers and noting the child in childExited
+ *   before returning; the caller reaps
+ * Returns the EVENT_ bits of what happened
+ */
+static int waitEvent(int inputFd)
+{
+   struct epoll_event events[3];
+   int happened = 0;
+
+   struct epoll_event input = { .events = EPOLLIN, .data.fd = inputFd };
+   if (inputFd != -1
+       && epoll_ctl(eventFd, EPOLL_CTL_ADD, inputFd, &input) == -1)
+   {
+      return EVENT_INPUT;                      // A file, always readable
+   }
+
+   while (happened == 0)
+   {
+      int numEvents = epoll_wait(eventFd, events, 3, -1);
+      if (numEvents == -1 && errno != EINTR)
+      {
+         perror("Event wait failed");
+         happened = EVENT_INPUT | EVENT_CHILD; // Let the caller go on
+      }
+      for (int e = 0; e < numEvents; e++)
+      {
+         if (events[e].data.fd == childFd)
+         {
+            struct signalfd_siginfo info;
+            while (read(childFd, &info, sizeof(info)) > 0)
+            {
+            }
+            childExited = 1;
+            happened |= EVENT_CHILD;
+         }
+         else if (events[e].data.fd == timerFd)
+         {
+            fireTimers();
+            happened |= EVENT_TIMER;
+         }
+         else
+         {
+            happened |= EVENT_INPUT;
+         }
+      }
+   }
+
+   if (inputFd != -1)
+   {
+      epoll_ctl(eventFd, EPOLL_CTL_DEL, inputFd, NULL);
+   }
+   return happened;
+}
+
+
+/** ------------------------------- joinArgs ----------------------------------
+ * Joins a stage's words with spaces for the accounting log
+ * Returns a malloc()ed string, or NULL when there's no log
+ */
+static char *joinArgs(char **argv)
+{
+   size_t len = 1;
+
+   if (acctFd == -1)
+   {
+      return NULL;
+   }
+   for (int a = 0; argv[a] != NULL; a++)
+   {
+      len += strlen(argv[a]) + 1;
+   }
+   char *text = malloc(len);
+   char *out = text;
+   for (int a = 0; text != NULL && argv[a] != NULL; a++)
+   {
+      out = stpcpy(out, argv[a]);
+      *out++ = ' ';
+   }
+   if (text != NULL)
+   {
+      out[out > text ? -1 : 0] = '\0';
+   }
+   return text;
+}
+
+
+/** ------------------------------- addUsage ----------------------------------
+ * Adds one child's CPU times into total and keeps the larger max RSS
+ */
+static void addUsage(struct rusage *total, const struct rusage *usage)
+{
+   timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+   timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+   if (usage->ru_maxrss > total->ru_maxrss)
+   {
+      total->ru_maxrss = usage->ru_maxrss;
+   }
+}
+
+
+/** ------------------------------- logUsage ----------------------------------
+ * Appends a finished child to the accounting log, if there is one
+ */
+static void logUsage(pid_t pid, int status, double started,
+                     const struct rusage *usage, const char *argv)
+{
+   char line[256];
+
+   if (acctFd == -1)
+   {
+      return;
+   }
+   int len = snprintf(line, sizeof(line), "%d\t%d\t%.3f\t%.3f\t%.3f\t%ld\t",
+                      (int)pid, WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                                    : WEXITSTATUS(status),
+                      (nowUsec() - started) / 1e3,
+                      usage->ru_utime.tv_sec * 1e3
+                      + usage->ru_utime.tv_usec / 1e3,
+                      usage->ru_stime.tv_sec * 1e3
+                      + usage->ru_stime.tv_usec / 1e3,
+                      usage->ru_maxrss);
+   struct iovec parts[3] =
+   {
+      { line, len },
+      { (void *)(argv != NULL ? argv : "?"), argv != NULL ? strlen(argv) : 1 },
+      { "\n", 1 },
+   };
+   writev(acctFd, parts, 3);                   // One append per line
+}
+
+
+
+/* Exit code of the last command, exit uses it when it isn't given one */
+static int lastStatus = 0;
+
+
+/** ------------------------------- jobState ----------------------------------
+ * Recomputes a job's state from its processes, a job is running while any
+ *   stage runs, stopped if none runs but one is stopped, and done once
+ *   every stage is done
+ */
+static void jobState(Job *job)
+{
+   int state = JOB_DONE;
+
+   for (int p = 0; p < job->numProcs; p++)
+   {
+      if (job->procs[p].state == JOB_RUNNING)
+      {
+         state = JOB_RUNNING;
+      }
+      else if (job->procs[p].state == JOB_STOPPED && state == JOB_DONE)
+      {
+         state = JOB_STOPPED;
+      }
+   }
+
+   if (state != job->state)
+   {
+      job->state = state;
+      job->notify = 1;
+   }
+}
+
+
+static void workerReaped(pid_t pid, int status, const struct rusage *usage);
+
+
+/** ------------------------------ updateProc ---------------------------------
+ * Records a wait status for pid in whichever job it belongs to, or in its
+ *   pool if it's a coproc worker that exited
+ * Returns the job or NULL if pid isn't part of one
+ */
+static Job *updateProc(pid_t pid, int status, const struct rusage *usage)
+{
+   for (int j = 0; j < MAX_JOBS; j++)
+   {
+      for (int p = 0; jobs[j].pgid != 0 && p < jobs[j].numProcs; p++)
+      {
+         JobProc *proc = &jobs[j].procs[p];
+         if (proc->pid != pid)
+         {
+            continue;
+         }
+
+         if (WIFSTOPPED(status))
+         {
+            proc->state = JOB_STOPPED;
+         }
+         else if (WIFCONTINUED(status))
+         {
+            proc->state = JOB_RUNNING;
+         }
+         else
+         {
+            proc->state = JOB_DONE;
+            proc->status = status;
+            proc->usage = *usage;
+            logUsage(pid, status, jobs[j].started, usage, proc->argv);
+         }
+         jobState(&jobs[j]);
+         return &jobs[j];
+      }
+   }
+   if (!WIFSTOPPED(status) && !WIFCONTINUED(status))
+   {
+      workerReaped(pid, status, usage);
+   }
+   return NULL;
+}
+
+
+/** ------------------------------- addJob ------------------------------------
+ * Puts a newly launched pipeline in the job table and returns its number,
+ *   or 0 if the table is full (the job still runs, it just isn't tracked)
+ * pids[p] runs stages[p], started is when the first one was launched
+ */
+static int addJob(pid_t pgid, const pid_t pids[], const Stage stages[],
+                  int numPids, const char *command, double started)
+{
+   for (int j = 0; j < MAX_JOBS; j++)
+   {
+      if (jobs[j].pgid == 0)
+      {
+         jobs[j].pgid = pgid;
+         jobs[j].procs = malloc(numPids * sizeof(JobProc));
+         if (jobs[j].procs == NULL)
+         {
+            perror("Out of memory");
+            jobs[j].pgid = 0;                 // Left untracked, like when
+            return 0;                         //   the table is full
+         }
+         for (int p = 0; p < numPids; p++)
+         {
+            memset(&jobs[j].procs[p], 0, sizeof(JobProc));
+            jobs[j].procs[p].pid = pids[p];
+            jobs[j].procs[p].state = JOB_RUNNING;
+            jobs[j].procs[p].argv = joinArgs(stages[p].argv);
+         }
+         jobs[j].numProcs = numPids;
+         jobs[j].state = JOB_RUNNING;
+         jobs[j].notify = 0;
+         jobs[j].seq = ++jobSeq;
+         jobs[j].command = strdup(command);
+         jobs[j].started = started;
+         return j + 1;
+      }
+   }
+   fprintf(stderr, "Job table full, not tracking: %s\n", command);
+   return 0;
+}
+
+
+/** ------------------------------ removeJob ----------------------------------
+ * Frees a job's slot
+ */
+static void removeJob(Job *job)
+{
+   for (int p = 0; p < job->numProcs; p++)
+   {
+      free(job->procs[p].argv);
+   }
+   free(job->procs);
+   free(job->command);
+   if (job->cgroup != NULL)
+   {
+      rmdir(job->cgroup);                      // Fails while it's not empty
+      free(job->cgroup);
+   }
+   memset(job, 0, sizeof(*job));
+}
+
+
+/** ------------------------------ jobStatus ----------------------------------
+ * Describes a job's state the way the jobs builtin prints it
+ */
+static void jobStatus(const Job *job, char *text, size_t size)
+{
+   if (job->state == JOB_RUNNING)
+   {
+      snprintf(text, size, "Running");
+   }
+   else if (job->state == JOB_STOPPED)
+   {
+      snprintf(text, size, "Stopped");
+   }
+   else
+   {
+      int status = job->procs[job->numProcs - 1].status;
+
+      if (WIFSIGNALED(status))
+      {
+         snprintf(text, size, "%s", strsignal(WTERMSIG(status)));
+      }
+      else if (WEXITSTATUS(status) != 0)
+      {
+         snprintf(text, size, "Exit %d", WEXITSTATUS(status));
+      }
+      else
+      {
+         snprintf(text, size, "Done");
+      }
+   }
+}
+
+
+/** ------------------------------ currentJob ---------------------------------
+ * Returns the most recently started or stopped job, or NULL if none
+ */
+static Job *currentJob(void)
+{
+   Job *best = NULL;
+
+   for (int j = 0; j < MAX_JOBS; j++)
+   {
+      if (jobs[j].pgid != 0 && (best == NULL || jobs[j].seq > best->seq))
+      {
+         best = &jobs[j];
+      }
+   }
+   return best;
+}
+
+
+/** ------------------------------- printJob ----------------------------------
+ * Prints one line of the jobs listing, with every pid when longForm is set
+ */
+static void printJob(Job *job, int longForm)
+{
+   char text[64];
+
+   jobStatus(job, text, sizeof(text));
+   printf("[%d]%c  ", (int)(job - jobs) + 1, job == currentJob() ? '+' : ' ');
+   if (longForm)
+   {
+      for (int p = 0; p < job->numProcs; p++)
+      {
+         printf("%d ", (int)job->procs[p].pid);
+      }
+   }
+   printf("%-10s %s\n", text, job->command);
+   job->notify = 0;
+}
+
+
+/** ----------------------------- reapChildren --------------------------------
+ * Collects every child that has already exited or stopped without
+ *   blocking, so finished background commands don't pile up as zombies
+ */
+static void reapChildren(void)
+{
+   pid_t pid;
+   int status;
+   struct rusage usage;
+
+   if (!childExited)
+   {
+      return;
+   }
+   childExited = 0;
+
+   while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED,
+                       &usage)) > 0)
+   {
+      updateProc(pid, status, &usage);
+   }
+}
+
+
+/** ------------------------------ notifyJobs ---------------------------------
+ * Reports jobs that finished or stopped since the last prompt, finished
+ *   ones are removed from the table
+ */
+static void notifyJobs(void)
+{
+   reapChildren();
+
+   for (int j = 0; j < MAX_JOBS; j++)
+   {
+      if (jobs[j].pgid != 0 && jobs[j].notify)
+      {
+         if (interactive)
+         {
+            printJob(&jobs[j], 0);
+         }
+         if (jobs[j].state == JOB_DONE)
+         {
+            removeJob(&jobs[j]);
+         }
+      }
+   }
+}
+
+
+/* Set when TMOUT ran out before a line was typed */
+static int inputTimedOut = 0;
+
+
+/** ------------------------------ waitInput ----------------------------------
+ * Waits in the event loop until fd can be read, reaping the background
+ *   children that change state meanwhile
+ * With jobsToo it stops early once there's a job for notifyJobs() to report
+ * Returns 1 when fd can be read, 0 for a job to report, -1 if TMOUT ran out
+ */
+static int waitInput(int fd, int jobsToo)
+{
+   for (;;)
+   {
+      int happened = waitEvent(fd);
+      if (inputTimedOut)
+      {
+         return -1;
+      }
+      if (happened & EVENT_INPUT)
+      {
+         return 1;
+      }
+      reapChildren();
+      for (int j = 0; jobsToo && j < MAX_JOBS; j++)
+      {
+         if (jobs[j].pgid != 0 && jobs[j].notify)
+         {
+            return 0;
+         }
+      }
+   }
+}
+
+
+/** ---------------------------- initJobControl -------------------------------
+ * Sets up job control for an interactive shell: waits until it's in the
+ *   foreground, ignores the keyboard signals (^C only sets interrupted),
+ *   moves into a process group of its own and takes the terminal
+ */
+static void initJobControl(void)
+{
+   while (tcgetpgrp(STDIN_FILENO) != getpgrp())   // Started with &
+   {
+      kill(-getpgrp(), SIGTTIN);
+   }
+   for (int s = 0; s < NUM_JOB_SIGNALS; s++)
+   {
+      signal(jobSignals[s], SIG_IGN);
+   }
+
+   // ^C in a loop of builtins has to stop the loop
+   struct sigaction intAction;
+   memset(&intAction, 0, sizeof(intAction));
+   intAction.sa_handler = onSigint;
+   intAction.sa_flags = SA_RESTART;
+   sigemptyset(&intAction.sa_mask);
+   sigaction(SIGINT, &intAction, NULL);
+
+   setpgid(0, 0);                   // Fails harmlessly for a session leader
+   shellPgid = getpgrp();
+   tcsetpgrp(STDIN_FILENO, shellPgid);
+   tcgetattr(STDIN_FILENO, &shellModes);
+}
+
+
+/** ------------------------------ takeTerminal -------------------------------
+ * Makes the shell the terminal's foreground process group again, with the
+ *   terminal modes it had, after a foreground job exits or stops
+ */
+static void takeTerminal(void)
+{
+   tcsetpgrp(STDIN_FILENO, shellPgid);
+   tcsetattr(STDIN_FILENO, TCSADRAIN, &shellModes);
+}
+
+
+/** ------------------------------- exitCode ----------------------------------
+ * Turns a wait status into a shell exit code, 128 + N for signal N
+ */
+static int exitCode(int status)
+{
+   if (WIFSIGNALED(status))
+   {
+      return 128 + WTERMSIG(status);
+   }
+   return WEXITSTATUS(status);
+}
+
+
+/** ------------------------------- waitJob -----------------------------------
+ * Blocks in the event loop until every stage of the job is done or one of
+ *   them stops, so timers still fire and background jobs that finish
+ *   meanwhile are reaped too
+ * Returns the wait status of the last stage
+ */
+static int waitJob(Job *job)
+{
+   while (job->state == JOB_RUNNING)
+   {
+      int status;
+      struct rusage usage;
+      pid_t pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED,
+                        &usage);
+
+      if (pid > 0)
+      {
+         updateProc(pid, status, &usage);
+      }
+      else if (pid == 0)
+      {
+         waitEvent(-1);
+      }
+      else if (errno == ECHILD)                // Already reaped elsewhere
+      {
+         for (int p = 0; p < job->numProcs; p++)
+         {
+            if (job->procs[p].state == JOB_RUNNING)
+            {
+               job->procs[p].state = JOB_DONE;
+            }
+         }
+         jobState(job);
+      }
+   }
+   return job->procs[job->numProcs - 1].status;
+}
+
+
+/** -------------------------------- findJob ----------------------------------
+ * Turns a job spec (%n, %%, %+ or a pid) into a job, NULL spec means the
+ *   current job
+ * Prints an error and returns NULL if there's no such job
+ */
+static Job *findJob(const char *name, const char *spec)
+{
+   Job *job = NULL;
+
+   if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+   {
+      job = currentJob();
+   }
+   else if (spec[0] == '%')
+   {
+      int n = atoi(spec + 1);
+      if (n >= 1 && n <= MAX_JOBS && jobs[n - 1].pgid != 0)
+      {
+         job = &jobs[n - 1];
+      }
+   }
+   else
+   {
+      pid_t pid = atoi(spec);
+      for (int j = 0; j < MAX_JOBS && job == NULL; j++)
+      {
+         for (int p = 0; jobs[j].pgid != 0 && p < jobs[j].numProcs; p++)
+         {
+            if (jobs[j].procs[p].pid == pid)
+            {
+               job = &jobs[j];
+            }
+         }
+      }
+   }
+
+   if (job == NULL)
+   {
+      fprintf(stderr, "%s: %s: no such job\n", name,
+              spec != NULL ? spec : "current");
+   }
+   return job;
+}
+
+
+/** ------------------------------- builtinJobs -------------------------------
+ * jobs [-l]      lists every job, -l adds the pids of each stage
+ */
+static int builtinJobs(char **args)
+{
+   int longForm = args[1] != NULL && strcmp(args[1], "-l") == 0;
+
+   reapChildren();                            // Show up to date states
+   for (int j = 0; j < MAX_JOBS; j++)
+   {
+      if (jobs[j].pgid != 0)
+      {
+         printJob(&jobs[j], longForm);
+         if (jobs[j].state == JOB_DONE)
+         {
+            removeJob(&jobs[j]);
+         }
+      }
+   }
+   return 0;
+}
+
+
+/** ------------------------------- builtinFg ---------------------------------
+ * fg [%n]        continues a job and waits for it like a foreground command
+ * bg [%n]        continues a stopped job in the background
+ * Returns the job's exit code for fg, else 0
+ */
+static int builtinFgBg(char **args, int foreground)
+{
+   int status = 0;
+   reapChildren();
+   Job *job = findJob(args[0], args[1]);
+
+   if (job == NULL)
+   {
+      return 1;
+   }
+
+   if (foreground)
+   {
+      printf("%s\n", job->command);
+   }
+   else
+   {
+      printf("[%d] %s &\n", (int)(job - jobs) + 1, job->command);
+   }
+   fflush(stdout);
+
+   for (int p = 0; p < job->numProcs; p++)   // The stop is over
+   {
+      if (job->procs[p].state == JOB_STOPPED)
+      {
+         job->procs[p].state = JOB_RUNNING;
+      }
+   }
+   jobState(job);
+   job->notify = 0;
+   job->seq = ++jobSeq;
+   if (foreground && interactive)
+   {
+      tcsetpgrp(STDIN_FILENO, job->pgid);    // Before it can read input
+   }
+   kill(-job->pgid, SIGCONT);
+
+   if (foreground)
+   {
+      status = exitCode(waitJob(job));
+      if (interactive)
+      {
+         takeTerminal();
+      }
+      if (job->state == JOB_DONE)
+      {
+         removeJob(job);
+      }
+      else
+      {
+         printJob(job, 0);
+      }
+   }
+   return status;
+}
+
+/* fg and bg entries of the builtin table */
+static int builtinFg(char **args)
+{
+   return builtinFgBg(args, 1);
+}
+
+static int builtinBg(char **args)
+{
+   return builtinFgBg(args, 0);
+}
+
+
+/** ------------------------------ builtinWait --------------------------------
+ * wait           waits for every running job
+ * wait %n|pid... waits for each given job
+ * Returns the exit code of the last job waited for (127 if it doesn't exist)
+ */
+static int builtinWait(char **args)
+{
+   int status = 0;
+
+   if (args[1] == NULL)
+   {
+      for (int j = 0; j < MAX_JOBS; j++)
+      {
+         if (jobs[j].pgid != 0 && jobs[j].state == JOB_RUNNING)
+         {
+            waitJob(&jobs[j]);
+            if (jobs[j].state == JOB_DONE)
+            {
+               removeJob(&jobs[j]);
+            }
+         }
+      }
+      return 0;
+   }
+
+   for (int a = 1; args[a] != NULL; a++)
+   {
+      Job *job = findJob("wait", args[a]);
+      status = 127;
+      if (job != NULL)
+      {
+         status = exitCode(waitJob(job));
+         if (job->state == JOB_DONE)
+         {
+            removeJob(job);
+         }
+      }
+   }
+   return status;
+}
+
+
+/* Signal names understood by kill, the SIG prefix is optional */
+static const struct { const char *name; int sig; } signalNames[] =
+{
+   { "HUP", SIGHUP },   { "INT", SIGINT },   { "QUIT", SIGQUIT },
+   { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+   { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+   { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+};
+
+
+/** ------------------------------ parseSignal --------------------------------
+ * Turns a signal name (TERM or SIGTERM) or number into the signal
+ * Returns it, or -1 if there's no such signal
+ */
+static int parseSignal(const char *name)
+{
+   if (strncmp(name, "SIG", 3) == 0)
+   {
+      name += 3;
+   }
+   if (*name >= '0' && *name <= '9')
+   {
+      return atoi(name);
+   }
+   for (size_t n = 0; n < sizeof(signalNames) / sizeof(signalNames[0]); n++)
+   {
+      if (strcmp(name, signalNames[n].name) == 0)
+      {
+         return signalNames[n].sig;
+      }
+   }
+   return -1;
+}
+
+
+/** ------------------------------ builtinKill --------------------------------
+ * kill [-SIG] %n|pid...   sends SIG (default TERM) to each job's whole
+ *                         process group, or to each pid
+ */
+static int builtinKill(char **args)
+{
+   int sig = SIGTERM;
+   int a = 1;
+
+   if (args[a] != NULL && args[a][0] == '-')
+   {
+      sig = parseSignal(args[a] + 1);
+      if (sig == -1)
+      {
+         fprintf(stderr, "kill: unknown signal %s\n", args[a]);
+         return 1;
+      }
+      a++;
+   }
+
+   if (args[a] == NULL)
+   {
+      fprintf(stderr, "kill: usage: kill [-SIG] %%n|pid...\n");
+      return 2;
+   }
+
+   int status = 0;
+   for (; args[a] != NULL; a++)
+   {
+      pid_t target;
+
+      if (args[a][0] == '%')
+      {
+         Job *job = findJob("kill", args[a]);
+         if (job == NULL)
+         {
+            status = 1;
+            continue;
+         }
+         target = -job->pgid;                  // Every stage of the job
+      }
+      else
+      {
+         target = atoi(args[a]);
+      }
+
+      if (target == 0 || kill(target, sig) == -1)
+      {
+         fprintf(stderr, "kill: %s: %s\n", args[a],
+                 target == 0 ? "bad pid" : strerror(errno));
+         status = 1;
+      }
+   }
+   return status;
+}
+
+
+/** ------------------------------ closePipes ---------------------------------
+ * Closes both ends of the first numPipes pipes in the array
+ */
+static void closePipes(int pipes[][2], int numPipes)
+{
+   for (int p = 0; p < numPipes; p++)
+   {
+      close(pipes[p][READ]);
+      close(pipes[p][WRITE]);
+   }
+}
+
+
+/** ------------------------------- makePipe ----------------------------------
+ * pipe() with the capacity asked for by set pipesize, complaining about a
+ *   size it couldn't set only if report is set
+ * Returns 0, or -1 with errno set
+ */
+static int makePipe(int fds[2], int report)
+{
+   if (pipe(fds) == -1)
+   {
+      return -1;
+   }
+
+   // A bigger pipe lets fast stages move more per context switch, the
+   //   kernel rounds the size up to whole pages and caps it at
+   //   /proc/sys/fs/pipe-max-size for non-root users
+   if (pipeSize > 0 && fcntl(fds[WRITE], F_SETPIPE_SZ, pipeSize) == -1
+       && report)
+   {
+      perror("Pipe size not set");
+   }
+   lastPipeSize = fcntl(fds[WRITE], F_GETPIPE_SZ);
+   return 0;
+}
+
+
+/* Resource limits set with ulimit, which every child applies with
+ *   setrlimit() before executing its command; the shell itself never runs
+ *   under them, so a CPU limit can't take it down with a runaway job */
+static const struct
+{
+   char option;
+   int resource;
+   rlim_t unit;            // Bytes or seconds per unit ulimit shows
+   const char *name;
+} limitKinds[] =
+{
+   { 'c', RLIMIT_CORE, 1024, "core file size (KiB)" },
+   { 'd', RLIMIT_DATA, 1024, "data seg size (KiB)" },
+   { 'f', RLIMIT_FSIZE, 1024, "file size (KiB)" },
+   { 'n', RLIMIT_NOFILE, 1, "open files" },
+   { 's', RLIMIT_STACK, 1024, "stack size (KiB)" },
+   { 't', RLIMIT_CPU, 1, "cpu time (seconds)" },
+   { 'u', RLIMIT_NPROC, 1, "max user processes" },
+   { 'v', RLIMIT_AS, 1024, "virtual memory (KiB)" },
+};
+#define NUM_LIMITS (int)(sizeof(limitKinds) / sizeof(limitKinds[0]))
+static struct rlimit childLimits[NUM_LIMITS];
+static int limitSet[NUM_LIMITS];
+static int numLimitsSet = 0;
+
+
+/** ------------------------------ builtinUlimit ------------------------------
+ * ulimit [-a | -cdfnstuv] [N|unlimited]
+ *   shows the limit (-f when none is given), or sets it to N for every
+ *   command started from now on, in the units ulimit -a shows
+ * Returns 1 for a bad number or one above the hard limit
+ */
+static int builtinUlimit(char **args)
+{
+   int kind = 2;                               // -f
+   int all = 0;
+   int a = 1;
+
+   if (args[a] != NULL && args[a][0] == '-')
+   {
+      all = strcmp(args[a], "-a") == 0;
+      for (kind = 0; !all && kind < NUM_LIMITS; kind++)
+      {
+         if (args[a][1] == limitKinds[kind].option && args[a][2] == '\0')
+         {
+            break;
+         }
+      }
+      if (kind == NUM_LIMITS)
+      {
+         fprintf(stderr, "ulimit: usage: ulimit [-a | -cdfnstuv] "
+                         "[N|unlimited]\n");
+         return 2;
+      }
+      a++;
+   }
+
+   if (all || args[a] == NULL)                 // Show
+   {
+      for (int l = all ? 0 : kind; l < (all ? NUM_LIMITS : kind + 1); l++)
+      {
+         struct rlimit now;
+         getrlimit(limitKinds[l].resource, &now);
+         rlim_t cur = limitSet[l] ? childLimits[l].rlim_cur : now.rlim_cur;
+         if (all)
+         {
+            printf("%-24s(-%c) ", limitKinds[l].name, limitKinds[l].option);
+         }
+         if (cur == RLIM_INFINITY)
+         {
+            printf("unlimited\n");
+         }
+         else
+         {
+            printf("%llu\n", (unsigned long long)(cur / limitKinds[l].unit));
+         }
+      }
+      return 0;
+   }
+
+   rlim_t value = RLIM_INFINITY;
+   if (strcmp(args[a], "unlimited") != 0)
+   {
+      char *end;
+      errno = 0;
+      unsigned long long n = strtoull(args[a], &end, 10);
+      if (errno != 0 || end == args[a] || *end != '\0' || args[a][0] == '-'
+          || n > (RLIM_INFINITY - 1) / limitKinds[kind].unit)
+      {
+         fprintf(stderr, "ulimit: %s: bad number\n", args[a]);
+         return 1;
+      }
+      value = n * limitKinds[kind].unit;
+   }
+
+   struct rlimit now;
+   getrlimit(limitKinds[kind].resource, &now);
+   if (value > now.rlim_max && geteuid() != 0)
+   {
+      fprintf(stderr, "ulimit: %s: above the hard limit\n", args[a]);
+      return 1;
+   }
+   childLimits[kind].rlim_cur = value;
+   childLimits[kind].rlim_max = value > now.rlim_max ? value : now.rlim_max;
+   numLimitsSet += !limitSet[kind];
+   limitSet[kind] = 1;
+   return 0;
+}
+
+
+/* Placement of the jobs the shell starts (set cgroup=, cpumax=, memmax=,
+ *   cpus= and the @cpus= prefix): with a cgroup v2 directory set, every
+ *   job gets a cgroup of its own under it, limited by cpu.max and
+ *   memory.max, and a CPU list pins its processes with sched_setaffinity()
+ * Each child does both itself between fork() and exec */
+enum { CPUS_ANY, CPUS_LIST, CPUS_SPREAD };
+static char *cgroupDir = NULL;     // NULL keeps jobs in the shell's cgroup
+static long cpuMaxPercent = 0;     // Of one CPU, 0 = no cpu.max
+static long memMax = 0;            // Bytes, 0 = no memory.max
+static unsigned long cgroupSeq = 0;
+static int cpusMode = CPUS_ANY;
+static cpu_set_t defaultCpus;      // With CPUS_LIST
+static char *defaultCpusText = NULL;
+static int nextSpreadCpu = 0;      // Background jobs take turns with spread
+
+/* Set while a job is started, for setupStage() */
+static const cpu_set_t *launchCpus = NULL;
+static int launchCgroupFd = -1;    // cgroup.procs of the job's cgroup
+
+
+/** ------------------------------- parseCpus ---------------------------------
+ * Reads a CPU list like 0-3,6 into set
+ * Returns 0, or -1 if text isn't one
+ */
+static int parseCpus(const char *text, cpu_set_t *set)
+{
+   CPU_ZERO(set);
+   do
+   {
+      char *end;
+      long first = strtol(text, &end, 10);
+      long last = first;
+      if (end == text || first < 0)
+      {
+         return -1;
+      }
+      if (*end == '-')
+      {
+         text = end + 1;
+         last = strtol(text, &end, 10);
+         if (end == text || last < first)
+         {
+            return -1;
+         }
+      }
+      if (last >= CPU_SETSIZE)
+      {
+         return -1;
+      }
+      for (long cpu = first; cpu <= last; cpu++)
+      {
+         CPU_SET(cpu, set);
+      }
+      text = end;
+   } while (*text++ == ',');
+
+   return text[-1] == '\0' ? 0 : -1;
+}
+
+
+/** ------------------------------- spreadCpu ---------------------------------
+ * Puts the next of the CPUs the shell may run on in set, in turn, so
+ *   background jobs started one after another land on different cores
+ * Returns 0, or -1 if the shell's own CPUs can't be read
+ */
+static int spreadCpu(cpu_set_t *set)
+{
+   cpu_set_t allowed;
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+   {
+      return -1;
+   }
+
+   int count = CPU_COUNT(&allowed);
+   int pick = nextSpreadCpu++ % count;
+   CPU_ZERO(set);
+   for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+   {
+      if (CPU_ISSET(cpu, &allowed) && pick-- == 0)
+      {
+         CPU_SET(cpu, set);
+         break;
+      }
+   }
+   return 0;
+}
+
+
+/** ---------------------------- writeCgroupFile ------------------------------
+ * Writes text into the control file name of the cgroup at dir
+ * Returns 0, or -1 (after printing why) if it couldn't
+ */
+static int writeCgroupFile(const char *dir, const char *name,
+                           const char *text)
+{
+   char path[PATH_MAX];
+   snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+   int fd = open(path, O_WRONLY | O_CLOEXEC);
+   if (fd == -1 || write(fd, text, strlen(text)) == -1)
+   {
+      fprintf(stderr, "cgroup: %s: %s\n", path, strerror(errno));
+      if (fd != -1)
+      {
+         close(fd);
+      }
+      return -1;
+   }
+   close(fd);
+   return 0;
+}
+
+
+/** ----------------------------- makeJobCgroup -------------------------------
+ * Makes a cgroup for the next job under cgroupDir, named after the shell
+ *   and a count, with cpu.max and memory.max set if they were asked for
+ * Its path goes into path
+ * Returns its cgroup.procs open for the children to write themselves into,
+ *   or -1 (after printing why, and with nothing left behind)
+ */
+static int makeJobCgroup(char *path, size_t size)
+{
+   char text[64];
+
+   snprintf(path, size, "%s/osh-%d-%lu", cgroupDir, (int)getpid(),
+            ++cgroupSeq);
+   if (mkdir(path, 0755) == -1)
+   {
+      fprintf(stderr, "cgroup: %s: %s\n", path, strerror(errno));
+      return -1;
+   }
+
+   int failed = 0;
+   if (cpuMaxPercent > 0)                     // Quota per 100ms period
+   {
+      snprintf(text, sizeof(text), "%ld 100000", cpuMaxPercent * 1000);
+      failed |= writeCgroupFile(path, "cpu.max", text);
+   }
+   if (memMax > 0)
+   {
+      snprintf(text, sizeof(text), "%ld", memMax);
+      failed |= writeCgroupFile(path, "memory.max", text);
+   }
+
+   char procs[PATH_MAX + sizeof("/cgroup.procs")];
+   snprintf(procs, sizeof(procs), "%s/cgroup.procs", path);
+   int fd = failed ? -1 : open(procs, O_WRONLY | O_CLOEXEC);
+   if (fd == -1)
+   {
+      if (!failed)
+      {
+         fprintf(stderr, "cgroup: %s: %s\n", procs, strerror(errno));
+      }
+      rmdir(path);
+   }
+   return fd;
+}
+
+
+/** ------------------------------ setCgroupDir -------------------------------
+ * Has every job from now on get a cgroup under dir, or none for "off"
+ * Returns 0, or -1 (after printing why) if dir isn't a cgroup v2 directory
+ *   the shell can make cgroups in
+ */
+static int setCgroupDir(const char *dir)
+{
+   char procs[PATH_MAX];
+
+   snprintf(procs, sizeof(procs), "%s/cgroup.procs", dir);
+   if (strcmp(dir, "off") != 0
+       && (access(procs, W_OK) == -1 || access(dir, W_OK) == -1))
+   {
+      fprintf(stderr, "set: cgroup %s: %s\n", dir, strerror(errno));
+      return -1;
+   }
+   free(cgroupDir);
+   cgroupDir = strcmp(dir, "off") != 0 ? strdup(dir) : NULL;
+   return 0;
+}
+
+
+/** ------------------------------ childFail ----------------------------------
+ * Reports why a child couldn't start and exits it
+ * Only uses write() and _exit() so it is safe in a vfork() child, which
+ *   shares the shell's memory and stdio buffers
+ */
+static void childFail(const char *what, const char *name)
+{
+   const char *reason = strerror(errno);
+
+   write(STDERR_FILENO, what, strlen(what));
+   if (name != NULL)
+   {
+      write(STDERR_FILENO, " ", 1);
+      write(STDERR_FILENO, name, strlen(name));
+   }
+   write(STDERR_FILENO, ": ", 2);
+   write(STDERR_FILENO, reason, strlen(reason));
+   write(STDERR_FILENO, "\n", 1);
+   _exit(1);
+}
+
+
+/** ------------------------------ setupStage ---------------------------------
+ * Runs in a fork() or vfork() child to give it the stage's descriptors
+ * Joins process group pgid (0 starts a new one, -1 stays in the shell's)
+ *   and takes the terminal if it's a foreground job, gets the default
+ *   action back for the signals an interactive shell ignores,
+ *   wires the stage's stdin/stdout to inFd/outFd (-1 keeps the shell's),
+ *   closes every pipe, then applies its redirects with open() + dup2() so
+ *   data goes straight between the file and the command
+ */
+static void setupStage(const Stage *st, pid_t pgid, int inFd, int outFd,
+                       int pipes[][2], int numPipes)
+{
+   if (pgid != -1)
+   {
+      setpgid(0, pgid);
+      if (foregroundLaunch)                  // The shell does it too, this
+      {                                      //   way neither has to wait
+         tcsetpgrp(STDIN_FILENO, pgid != 0 ? pgid : getpid());
+      }
+   }
+   for (int s = 0; interactive && s < NUM_JOB_SIGNALS; s++)
+   {
+      signal(jobSignals[s], SIG_DFL);
+   }
+   sigprocmask(SIG_SETMASK, &childMask, NULL);   // SIGCHLD unblocked
+   for (int l = 0; numLimitsSet > 0 && l < NUM_LIMITS; l++)
+   {
+      if (limitSet[l]
+          && setrlimit(limitKinds[l].resource, &childLimits[l]) == -1)
+      {
+         childFail("Limit failed", NULL);
+      }
+   }
+   if (launchCgroupFd != -1 && write(launchCgroupFd, "0", 1) != 1)
+   {
+      childFail("Cgroup failed", NULL);       // "0" is the writer itself
+   }
+   if (launchCpus != NULL
+       && sched_setaffinity(0, sizeof(cpu_set_t), launchCpus) == -1)
+   {
+      childFail("Affinity failed", NULL);
+   }
+   if (inFd != -1)
+   {
+      dup2(inFd, STDIN_FILENO);
+   }
+   if (outFd != -1)
+   {
+      dup2(outFd, STDOUT_FILENO);
+   }
+   closePipes(pipes, numPipes);              // Only the dups stay open
+
+   for (int r = 0; r < st->numRedirs; r++)   // File redirects and dups
+   {
+      const Redirect *redir = &st->redirs[r];
+      int fd = redir->dupFrom;
+
+      if (fd == -1)
+      {
+         fd = open(redir->file, redir->flags, 0666);
+         if (fd == -1)
+         {
+            childFail(redir->flags == O_RDONLY ? "Input file failed"
+                                               : "Output file failed",
+                      redir->file);
+         }
+      }
+      if (fd != redir->fd)
+      {
+         if (dup2(fd, redir->fd) == -1)
+         {
+            childFail("Redirect failed", NULL);
+         }
+         if (redir->dupFrom == -1)
+         {
+            close(fd);
+         }
+      }
+   }
+}
+
+
+/** ------------------------------ execStage ----------------------------------
+ * Runs in a fork() or vfork() child and never returns
+ * Sets up the stage's descriptors then executes its command
+ */
+static void execStage(const Stage *st, pid_t pgid, int inFd, int outFd,
+                      int pipes[][2], int numPipes)
+{
+   setupStage(st, pgid, inFd, outFd, pipes, numPipes);
+   if (st->assigns != NULL)                  // Only ever in a fork() child
+   {
+      setAssigns(st->assigns, 1);
+      shellEnv();
+   }
+
+   traceChild(TRACE_EXEC, st->argv[0]);
+   if (st->path != NULL)                     // Found in the command hash
+   {
+      execv(st->path, st->argv);
+      if (errno == ENOENT && hashStale != NULL)
+      {
+         *hashStale = 1;                        // Tell the shell it moved
+      }
+   }
+   execvp(st->argv[0], st->argv);
+   childFail("Exec failed", st->argv[0]);
+}
+
+
+/** -------------------------------- copyFd -----------------------------------
+ * Copies everything from in to out, keeping the data in the kernel when it
+ *   can: splice() if either end is a pipe, sendfile() from a regular file,
+ *   and plain read()/write() for anything else (e.g. a terminal)
+ * Returns 0 on success or -1 with errno set
+ */
+static int copyFd(int in, int out)
+{
+   struct stat inInfo, outInfo;
+   ssize_t moved = 0;
+
+   if (fstat(in, &inInfo) == -1 || fstat(out, &outInfo) == -1)
+   {
+      return -1;
+   }
+
+   if (S_ISFIFO(inInfo.st_mode) || S_ISFIFO(outInfo.st_mode))
+   {
+      while ((moved = splice(in, NULL, out, NULL, 1 << 20,
+                             SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+      {
+      }
+   }
+   else if (S_ISREG(inInfo.st_mode))
+   {
+      while ((moved = sendfile(out, in, NULL, 1 << 30)) > 0)
+      {
+      }
+   }
+   else
+   {
+      errno = EINVAL;
+      moved = -1;
+   }
+
+   if (moved == 0)
+   {
+      return 0;
+   }
+   if (errno != EINVAL && errno != ENOSYS)    // A real error
+   {
+      return -1;
+   }
+
+   // These descriptors can't be spliced, copy through user space
+   char buffer[1 << 16];
+   ssize_t got;
+   while ((got = read(in, buffer, sizeof(buffer))) > 0)
+   {
+      for (ssize_t done = 0; done < got; )
+      {
+         ssize_t put = write(out, buffer + done, got - done);
+         if (put == -1)
+         {
+            return -1;
+         }
+         done += put;
+      }
+   }
+   return got == 0 ? 0 : -1;
+}
+
+
+/** ---------------------------- redirectsStdin -------------------------------
+ * Whether one of the stage's redirects replaces its stdin
+ */
+static int redirectsStdin(const Stage *st)
+{
+   for (int r = 0; r < st->numRedirs; r++)
+   {
+      if (st->redirs[r].fd == STDIN_FILENO)
+      {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+
+/** ------------------------------- isFastCat ---------------------------------
+ * Whether the stage is a cat with no options, which the shell runs itself
+ *   instead of executing /bin/cat
+ */
+static int isFastCat(const Stage *st)
+{
+   if (strcmp(st->argv[0], "cat") != 0)
+   {
+      return 0;
+   }
+   for (int a = 1; st->argv[a] != NULL; a++)
+   {
+      if (st->argv[a][0] == '-' && st->argv[a][1] != '\0')
+      {
+         return 0;                              // Leave options to cat
+      }
+   }
+   return 1;
+}
+
+
+/** ------------------------------- fastCat -----------------------------------
+ * Body of the builtin cat, run in a forked child that never executes
+ *   anything: copies each file (or stdin for none or -) to stdout with
+ *   copyFd(), so cat file | ... and ... | cat > file move the data kernel
+ *   side
+ * Returns the exit code
+ */
+static int fastCat(char **argv)
+{
+   int status = 0;
+
+   if (argv[1] == NULL)
+   {
+      if (copyFd(STDIN_FILENO, STDOUT_FILENO) == -1)
+      {
+         fprintf(stderr, "cat: %s\n", strerror(errno));
+         status = 1;
+      }
+      return status;
+   }
+
+   for (int a = 1; argv[a] != NULL; a++)
+   {
+      int fd = strcmp(argv[a], "-") == 0 ? STDIN_FILENO
+                                         : open(argv[a], O_RDONLY);
+      if (fd == -1 || copyFd(fd, STDOUT_FILENO) == -1)
+      {
+         fprintf(stderr, "cat: %s: %s\n", argv[a], strerror(errno));
+         status = 1;
+      }
+      if (fd > STDIN_FILENO)
+      {
+         close(fd);
+      }
+   }
+   return status;
+}
+
+
+/** ------------------------------ spawnStage ---------------------------------
+ * posix_spawnp() version of a fork() + execStage()
+ * The pipe dups, pipe closes and redirects are all expressed as file
+ *   actions, so the C library can start the child without copying the
+ *   shell's page tables
+ */
+static pid_t spawnStage(const Stage *st, pid_t pgid, int inFd, int outFd,
+                        int pipes[][2], int numPipes)
+{
+   posix_spawn_file_actions_t actions;
+   posix_spawnattr_t attr;
+   pid_t pid;
+
+   short flags = 0;
+   posix_spawnattr_init(&attr);
+   if (pgid != -1)
+   {
+      flags |= POSIX_SPAWN_SETPGROUP;
+      posix_spawnattr_setpgroup(&attr, pgid);
+   }
+   if (interactive)                             // Undo the shell's SIG_IGNs
+   {
+      sigset_t defaults;
+      sigemptyset(&defaults);
+      for (int s = 0; s < NUM_JOB_SIGNALS; s++)
+      {
+         sigaddset(&defaults, jobSignals[s]);
+      }
+      flags |= POSIX_SPAWN_SETSIGDEF;
+      posix_spawnattr_setsigdefault(&attr, &defaults);
+   }
+   flags |= POSIX_SPAWN_SETSIGMASK;             // SIGCHLD unblocked
+   posix_spawnattr_setsigmask(&attr, &childMask);
+   posix_spawnattr_setflags(&attr, flags);
+
+   posix_spawn_file_actions_init(&actions);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+   if (foregroundLaunch && pgid != -1)          // Take the terminal first
+   {
+      posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+   }
+#endif
+   if (inFd != -1)
+   {
+      posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+   }
+   if (outFd != -1)
+   {
+      posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+   }
+   for (int p = 0; p < numPipes; p++)
+   {
+      posix_spawn_file_actions_addclose(&actions, pipes[p][READ]);
+      posix_spawn_file_actions_addclose(&actions, pipes[p][WRITE]);
+   }
+   for (int r = 0; r < st->numRedirs; r++)
+   {
+      const Redirect *redir = &st->redirs[r];
+      if (redir->dupFrom == -1)
+      {
+         posix_spawn_file_actions_addopen(&actions, redir->fd, redir->file,
+                                          redir->flags, 0666);
+      }
+      else
+      {
+         posix_spawn_file_actions_adddup2(&actions, redir->dupFrom,
+                                          redir->fd);
+      }
+   }
+
+   int err = ENOENT;
+   if (st->path != NULL)                        // Found in the command hash
+   {
+      err = posix_spawn(&pid, st->path, &actions, &attr, st->argv, environ);
+      if (err == ENOENT)
+      {
+         forgetCommand(st->argv[0]);            // Moved, search PATH again
+      }
+   }
+   if (err == ENOENT)
+   {
+      err = posix_spawnp(&pid, st->argv[0], &actions, &attr,
+                         st->argv, environ);
+   }
+   posix_spawn_file_actions_destroy(&actions);
+   posix_spawnattr_destroy(&attr);
+
+   if (err != 0)
+   {
+      fprintf(stderr, "Spawn failed %s: %s\n", st->argv[0], strerror(err));
+      return -1;
+   }
+   return pid;
+}
+
+
+/** ------------------------------ launchStage --------------------------------
+ * Starts one stage with the selected launcher and returns its pid,
+ *   or -1 if it couldn't be started
+ * fork() copies the shell, vfork() borrows its memory until the child
+ *   calls exec, and posix_spawnp() leaves the details to the C library
+ * A builtin or plain cat is always forked, and its child runs the builtin
+ *   (or fastCat()) without an exec
+ */
+static pid_t launchStage(const Stage *st, pid_t pgid, int inFd, int outFd,
+                         int pipes[][2], int numPipes)
+{
+   pid_t pid;
+   const Builtin *builtin = findBuiltin(st->argv[0]);
+   BuiltinFn body = isFastCat(st) ? fastCat
+                                  : builtin != NULL ? builtin->run : NULL;
+
+   shellEnv();                       // Brings environ up to date
+   if (body != NULL)
+   {
+      pid = fork();
+      if (pid == 0)
+      {
+         setupStage(st, pgid, inFd, outFd, pipes, numPipes);
+         initEvents();               // timeout or wait may need a loop
+         traceFork();
+         if (st->assigns != NULL)
+         {
+            setAssigns(st->assigns, 1);
+         }
+         stdinRedirected = inFd != -1 || redirectsStdin(st);
+         int status = body(st->argv);
+         fflush(stdout);
+         traceFlush();
+         _exit(status);
+      }
+      if (pid < 0)
+      {
+         perror("Fork failed");
+      }
+      return pid;
+   }
+
+   // Assigns are made in the child, so only a fork() one will do, and
+   //   posix_spawn() has no way to set resource limits, a cgroup or CPUs
+   int how = st->assigns != NULL ? LAUNCH_FORK : launcher;
+   if (how == LAUNCH_SPAWN && (numLimitsSet > 0 || launchCgroupFd != -1
+                               || launchCpus != NULL))
+   {
+      how = LAUNCH_FORK;
+   }
+   switch (how)
+   {
+      case LAUNCH_SPAWN :
+         return spawnStage(st, pgid, inFd, outFd, pipes, numPipes);
+
+      case LAUNCH_VFORK :
+         pid = vfork();
+         break;
+
+      default :
+         pid = fork();
+         break;
+   }
+
+   if (pid == 0)              // ------------------------------ Child
+   {
+      execStage(st, pgid, inFd, outFd, pipes, numPipes);
+   }
+   else if (pid < 0)
+   {
+      perror("Fork failed");
+   }
+   return pid;
+}
+
+
+/** ----------------------------- runPipeline ---------------------------------
+ * Runs a command of the form a | b | c ... (a single command is just a
+ *   pipeline with one stage)
+ * The shell creates numStages - 1 pipes up front and launches every stage
+ *   as a sibling, so all stages run at the same time and stream through the
+ *   pipes instead of waiting on one another.
+ * Stage s reads from pipe s - 1 and writes to pipe s; the first stage keeps
+ *   the shell's stdin and the last stage keeps the shell's stdout.
+ * Unless the command ended with & the shell waits for every stage.
+ *   A background pipeline gets its own process group and an entry in the
+ *   job table under the given command text.
+ * An interactive shell gives every pipeline a process group, so one
+ *   kill(-pgid) reaches all its stages, and hands a foreground one the
+ *   terminal: ^C and ^Z go to the job instead of the shell, and a stopped
+ *   job stays in the job table
+ * With set cgroup= the job gets a cgroup of its own, removed once it's
+ *   done, and its stages run on cpus (NULL for what set cpus= says)
+ * Returns the exit code of the last stage (0 for a background pipeline,
+ *   128 + SIGTSTP for a stopped one)
+ */
+static int runPipeline(Stage stages[], int numStages, int bgProcess,
+                       const char *command, const cpu_set_t *cpus)
+{
+   int numPipes = numStages - 1;
+   int status = 0;
+   int pipes[numPipes > 0 ? numPipes : 1][2];
+   pid_t pids[numStages];
+   int numLaunched = 0;
+   pid_t pgid = bgProcess || interactive || ownGroup ? 0 : -1; // Stage 0's
+
+   for (int s = 0; s < numStages; s++)        // Reject a | | b, a |, etc.
+   {
+      if (stages[s].argv[0] == NULL)
+      {
+         fprintf(stderr, "Missing command in pipe\n");
+         return 2;
+      }
+   }
+
+   for (int p = 0; p < numPipes; p++)         // Make every pipe
+   {
+      if (makePipe(pipes[p], p == 0) == -1)
+      {
+         perror("Pipe failed");
+         closePipes(pipes, p);
+         return 1;
+      }
+   }
+
+   // Where the job goes, which each child sees to itself in setupStage()
+   char cgroup[PATH_MAX];
+   const char *jobCgroup = cgroupDir != NULL ? cgroup : NULL;
+   if (jobCgroup != NULL
+       && (launchCgroupFd = makeJobCgroup(cgroup, sizeof(cgroup))) == -1)
+   {
+      closePipes(pipes, numPipes);
+      return 1;
+   }
+   cpu_set_t spread;
+   launchCpus = cpus != NULL ? cpus
+                : cpusMode == CPUS_LIST ? &defaultCpus
+                : cpusMode == CPUS_SPREAD && bgProcess
+                  && spreadCpu(&spread) == 0 ? &spread : NULL;
+
+   fflush(stdout);            // Anything the shell printed goes first
+
+   double started = nowUsec();
+   foregroundLaunch = interactive && !bgProcess;
+   for (int s = 0; s < numStages; s++)
+   {
+      int inFd = s > 0 ? pipes[s - 1][READ] : -1;
+      int outFd = s < numPipes ? pipes[s][WRITE] : -1;
+      uint64_t traced = traceNow();
+      stages[s].path = findBuiltin(stages[s].argv[0]) == NULL
+                       ? lookupCommand(stages[s].argv[0]) : NULL;
+      traceEvent(TRACE_PATH, stages[s].argv[0], traced);
+      traced = traceNow();
+      pid_t pid = launchStage(&stages[s], pgid, inFd, outFd,
+                              pipes, numPipes);
+      traceEvent(TRACE_FORK, stages[s].argv[0], traced);
+
+      if (pid < 0)
+      {
+         break;
+      }
+      if (pgid == 0)
+      {
+         pgid = pid;
+      }
+      if (pgid != -1)         // Also set by the shell so the group is in
+      {                       //   place before anyone signals it
+         setpgid(pid, pgid);
+      }
+      if (foregroundLaunch && s == 0)
+      {
+         tcsetpgrp(STDIN_FILENO, pgid);
+      }
+      pids[numLaunched++] = pid;
+   }
+   foregroundLaunch = 0;
+   launchCpus = NULL;
+   if (launchCgroupFd != -1)
+   {
+      close(launchCgroupFd);
+      launchCgroupFd = -1;
+   }
+   if (bgProcess && numLaunched > 0)
+   {
+      lastBgPid = pids[numLaunched - 1];
+   }
+
+   // The shell keeps no pipe ends open, so each reader sees EOF as soon as
+   //   its writer exits
+   closePipes(pipes, numPipes);
+   foregroundPgid = bgProcess ? 0 : pgid;       // For a timeout meanwhile
+
+   // A foreground job of an interactive shell is waited for through the
+   //   job table, which notices it stopping
+   int id = 0;
+   if (bgProcess == 0 && interactive && numLaunched > 0)
+   {
+      id = addJob(pgid, pids, stages, numLaunched, command, started);
+   }
+   if (id != 0 && jobCgroup != NULL)
+   {
+      jobs[id - 1].cgroup = strdup(jobCgroup);
+   }
+   uint64_t waited = traceNow();
+   if (id != 0 && bgProcess == 0)
+   {
+      Job *job = &jobs[id - 1];
+      status = waitJob(job);
+      traceEvent(TRACE_WAIT, stages[0].argv[0], waited);
+      takeTerminal();
+      for (int p = 0; p < job->numProcs; p++)
+      {
+         addUsage(&pipelineUsage, &job->procs[p].usage);
+      }
+      if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+      {
+         printf("\n");                          // Past the ^C
+         interrupted = 1;
+      }
+      if (job->state == JOB_STOPPED)
+      {
+         printf("\n");                          // Past the ^Z
+         printJob(job, 0);
+         return 128 + SIGTSTP;
+      }
+      removeJob(job);
+      return numLaunched < numStages ? 1 : exitCode(status);
+   }
+
+   // Wait for every stage of the pipeline by pid, so a background
+   //   command finishing meanwhile can't be mistaken for one of them
+   if (bgProcess == 0)
+   {
+      status = 1 << 8;        // Exit 1 if the last stage didn't start
+      for (int s = 0; s < numLaunched; s++)
+      {
+         struct rusage usage;
+         memset(&usage, 0, sizeof(usage));
+         pid_t pid;
+         while ((pid = wait4(pids[s], &status, WNOHANG, &usage)) == 0
+                || (pid == -1 && errno == EINTR))
+         {
+            waitEvent(-1);
+         }
+         addUsage(&pipelineUsage, &usage);
+         if (acctFd != -1)
+         {
+            char *argv = joinArgs(stages[s].argv);
+            logUsage(pids[s], status, started, &usage, argv);
+            free(argv);
+         }
+      }
+      traceEvent(TRACE_WAIT, stages[0].argv[0], waited);
+      if (numLaunched < numStages)
+      {
+         status = 1 << 8;
+      }
+      if (interactive)
+      {
+         takeTerminal();
+      }
+   }
+   else if (numLaunched > 0)  // Track it, e.g. "[1] 1234"
+   {
+      id = addJob(pgid, pids, stages, numLaunched, command, started);
+      if (id != 0 && jobCgroup != NULL)
+      {
+         jobs[id - 1].cgroup = strdup(jobCgroup);
+      }
+      if (id != 0 && interactive)
+      {
+         printf("[%d] %d\n", id, (int)pids[numLaunched - 1]);
+      }
+   }
+   if (jobCgroup != NULL && id == 0)            // Waited for, or untracked
+   {
+      rmdir(jobCgroup);
+   }
+   return exitCode(status);
+}
+
+
+/* What the running timeout sends its command's group */
+static int timeoutSignal = SIGTERM;
+static int timedOut = 0;
+
+
+/** ------------------------------ onTimeout ----------------------------------
+ * Timer of the timeout builtin, signals the whole foreground job
+ */
+static void onTimeout(void *arg)
+{
+   (void)arg;
+   if (foregroundPgid > 0)
+   {
+      kill(-foregroundPgid, timeoutSignal);
+      kill(-foregroundPgid, SIGCONT);          // In case it was stopped
+   }
+   timedOut = 1;
+}
+
+
+/** ----------------------------- builtinTimeout ------------------------------
+ * timeout [-s SIG] DURATION COMMAND [ARG]...
+ *   runs COMMAND in a process group of its own and sends SIG (default
+ *   TERM) to the whole group if it's still running after DURATION, a
+ *   number of seconds with an optional s, m, h or d (0 never times out)
+ *   The shell's event loop times it, there's no timeout process
+ * Returns 124 if it timed out, otherwise the command's exit code
+ */
+static int builtinTimeout(char **args)
+{
+   int sig = SIGTERM;
+   int a = 1;
+
+   if (args[a] != NULL && strcmp(args[a], "-s") == 0 && args[a + 1] != NULL)
+   {
+      sig = parseSignal(args[a + 1]);
+      if (sig == -1)
+      {
+         fprintf(stderr, "timeout: unknown signal %s\n", args[a + 1]);
+         return 125;
+      }
+      a += 2;
+   }
+   if (args[a] == NULL || args[a + 1] == NULL)
+   {
+      fprintf(stderr, "timeout: usage: timeout [-s SIG] DURATION COMMAND "
+                      "[ARG]...\n");
+      return 125;
+   }
+
+   char *unit;
+   double seconds = strtod(args[a], &unit);
+   const char *units = "smhd";
+   const double scale[] = { 1, 60, 3600, 86400 };
+   if (unit == args[a] || seconds < 0
+       || (*unit != '\0' && (unit[1] != '\0' || strchr(units, *unit) == NULL)))
+   {
+      fprintf(stderr, "timeout: bad duration %s\n", args[a]);
+      return 125;
+   }
+   if (*unit != '\0')
+   {
+      seconds *= scale[strchr(units, *unit) - units];
+   }
+   a++;
+
+   char text[256];                             // For the job table
+   size_t len = 0;
+   text[0] = '\0';
+   for (int w = a; args[w] != NULL && len < sizeof(text); w++)
+   {
+      len += snprintf(text + len, sizeof(text) - len, w > a ? " %s" : "%s",
+                      args[w]);
+   }
+
+   Stage stage = { args + a, NULL, 0, NULL, NULL };
+   int timer = seconds > 0 ? addTimer(seconds * 1e6, onTimeout, NULL) : -1;
+   timeoutSignal = sig;
+   timedOut = 0;
+   ownGroup = 1;
+   int status = runPipeline(&stage, 1, 0, text, NULL);
+   ownGroup = 0;
+   cancelTimer(timer);
+   return timedOut ? 124 : status;
+}
+
+
+/** ------------------------------ reapSlot -----------------------------------
+ * Blocks until any child exits and frees its slot in running[] if it was
+ *   one of the parallel commands, other children are handed to the job
+ *   table
+ * Returns 1 if a parallel slot was freed, else 0
+ */
+static int reapSlot(pid_t running[], int numSlots, int *numFailed)
+{
+   int status;
+   struct rusage usage;
+   pid_t pid = wait4(-1, &status, 0, &usage);
+
+   if (pid == -1)             // EINTR, or ECHILD if a slot's child was
+   {                          //   already reaped elsewhere
+      for (int r = 0; errno == ECHILD && r < numSlots; r++)
+      {
+         if (running[r] != 0)
+         {
+            running[r] = 0;
+            return 1;
+         }
+      }
+      return 0;
+   }
+
+   for (int r = 0; r < numSlots; r++)
+   {
+      if (running[r] == pid)
+      {
+         running[r] = 0;
+         if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+         {
+            (*numFailed)++;
+         }
+         return 1;
+      }
+   }
+
+   updateProc(pid, status, &usage);            // A background job's stage
+   return 0;
+}
+
+
+static void substWords(char **words);
+static char **expandWords(Arena *arena, char **words);
+
+
+/** ---------------------------- launchParallel -------------------------------
+ * Starts one parallel command built from the template with every {}
+ *   replaced by input (or input appended when there is no {})
+ * An empty template means input is a whole command of its own
+ * The arguments are built in arena, which the caller resets
+ * Returns its pid or -1
+ */
+static pid_t launchParallel(Arena *arena, char **tmpl, int tmplLen,
+                            char *input, const char *inFile)
+{
+   size_t inLen = strlen(input);
+   char **argv = arenaAlloc(arena, (tmplLen + inLen / 2 + 2)
+                                   * sizeof(char *));
+   int argc = 0;
+   int used = 0;                               // Whether a {} was found
+
+   for (int t = 0; t < tmplLen; t++)
+   {
+      char *hole = strstr(tmpl[t], "{}");
+      if (hole == NULL)
+      {
+         argv[argc++] = tmpl[t];
+         continue;
+      }
+
+      // Replace every {} in this word
+      char *word = arenaAlloc(arena, strlen(tmpl[t]) * (inLen + 1) + 1);
+      char *out = word;
+      for (const char *c = tmpl[t]; *c != '\0'; c++)
+      {
+         if (c[0] == '{' && c[1] == '}')
+         {
+            memcpy(out, input, inLen);
+            out += inLen;
+            c++;
+         }
+         else
+         {
+            *out++ = *c;
+         }
+      }
+      *out = '\0';
+      argv[argc++] = word;
+      used = 1;
+   }
+
+   if (tmplLen == 0)                           // Input is the command
+   {
+      Token *tokens;
+      int numTokens = lexLine(arena, input, &tokens);
+      if (numTokens < 0)
+      {
+         fprintf(stderr, "parallel: unterminated quote\n");
+         return -1;
+      }
+
+      for (int t = 0; t < numTokens; t++)
+      {
+         if (tokens[t].type != TOK_WORD)
+         {
+            fprintf(stderr, "parallel: only simple commands can be read "
+                            "from stdin\n");
+            return -1;
+         }
+         argv[argc++] = tokens[t].text;
+      }
+      argv[argc] = NULL;
+      substWords(argv);
+      argv = expandWords(arena, argv);        // $ references in the line
+      argc = 0;
+      while (argv[argc] != NULL)
+      {
+         argc++;
+      }
+   }
+   else if (!used)
+   {
+      argv[argc++] = input;
+   }
+   argv[argc] = NULL;
+
+   pid_t pid = -1;
+   if (argc > 0)
+   {
+      Redirect fromFile = { STDIN_FILENO, -1, inFile, O_RDONLY };
+      Stage st = { argv, &fromFile, inFile != NULL, lookupCommand(argv[0]),
+                   NULL };
+      pid = launchStage(&st, -1, -1, -1, NULL, 0);
+   }
+
+   return pid;
+}
+
+
+/** ---------------------------- builtinParallel ------------------------------
+ * parallel [-j N] cmd args... ::: input...
+ *    runs cmd once per input, with {} in its arguments replaced by the input
+ *    (or the input added as the last argument)
+ * parallel [-j N] [cmd args...]
+ *    same, but the inputs are the lines read from stdin, and with no cmd
+ *    each line is a command of its own
+ * At most N (default: the number of CPUs, MAX_JOBS at most) commands run
+ *   at once, a new one is started as soon as any of them exits
+ */
+static int builtinParallel(char **args)
+{
+   long numSlots = sysconf(_SC_NPROCESSORS_ONLN);
+   int a = 1;
+
+   if (args[a] != NULL && strcmp(args[a], "-j") == 0)
+   {
+      char *end = NULL;
+      numSlots = args[a + 1] != NULL ? strtol(args[a + 1], &end, 10) : 0;
+      if (end == NULL || end == args[a + 1] || *end != '\0'
+          || numSlots < 1 || numSlots > MAX_JOBS)
+      {
+         fprintf(stderr, "parallel: -j needs a number from 1 to %d\n",
+                 MAX_JOBS);
+         return 2;
+      }
+      a += 2;
+   }
+   if (numSlots < 1)
+   {
+      numSlots = 1;
+   }
+   if (numSlots > MAX_JOBS)           // running[] is on the stack
+   {
+      numSlots = MAX_JOBS;
+   }
+
+   char **tmpl = &args[a];
+   int tmplLen = 0;
+   while (tmpl[tmplLen] != NULL && strcmp(tmpl[tmplLen], ":::") != 0)
+   {
+      tmplLen++;
+   }
+   char **inputs = tmpl[tmplLen] != NULL ? &tmpl[tmplLen + 1] : NULL;
+
+   if (inputs != NULL && tmplLen == 0)
+   {
+      fprintf(stderr, "parallel: missing command before :::\n");
+      return 2;
+   }
+
+   // A redirected or piped stdin is read through a stream of its own, the
+   //   stdin stream may hold buffered lines of the shell's input
+   FILE *lines = stdin;
+   if (inputs == NULL && stdinRedirected)
+   {
+      lines = fdopen(dup(STDIN_FILENO), "r");
+      if (lines == NULL)
+      {
+         perror("parallel");
+         return 1;
+      }
+   }
+
+   pid_t running[numSlots];
+   int numRunning = 0;
+   int numFailed = 0;
+   int numStarted = 0;
+   char *line = NULL;
+   size_t lineSize = 0;
+   Arena arena = { NULL };
+   memset(running, 0, sizeof(running));
+
+   for (int i = 0; ; i++)
+   {
+      char *input;
+
+      if (inputs != NULL)                      // Inputs after :::
+      {
+         input = inputs[i];
+      }
+      else                                     // One input per stdin line
+      {
+         ssize_t len = getline(&line, &lineSize, lines);
+         input = len > 0 ? line : NULL;
+         if (len > 0 && line[len - 1] == '\n')
+         {
+            line[len - 1] = '\0';
+         }
+      }
+      if (input == NULL)
+      {
+         break;
+      }
+      if (input[0] == '\0')
+      {
+         continue;
+      }
+
+      while (numRunning == numSlots)           // Wait for a free slot
+      {
+         numRunning -= reapSlot(running, numSlots, &numFailed);
+      }
+
+      // Commands read from stdin mustn't also read the rest of it
+      pid_t pid = launchParallel(&arena, tmpl, tmplLen, input,
+                                 inputs == NULL ? "/dev/null" : NULL);
+      arenaReset(&arena);
+      if (pid < 0)
+      {
+         numFailed++;
+         continue;
+      }
+      for (int r = 0; r < numSlots; r++)
+      {
+         if (running[r] == 0)
+         {
+            running[r] = pid;
+            break;
+         }
+      }
+      numRunning++;
+      numStarted++;
+   }
+   free(line);
+   free(arena.head);
+   if (lines != stdin)
+   {
+      fclose(lines);
+   }
+
+   while (numRunning > 0)                      // Wait for the rest
+   {
+      numRunning -= reapSlot(running, numSlots, &numFailed);
+   }
+
+   if (numFailed > 0)
+   {
+      fprintf(stderr, "parallel: %d of %d commands failed\n",
+              numFailed, numStarted);
+   }
+   return numFailed > 0;
+}
+
+
+/* Worker pools started with coproc: N copies of one long running command,
+ *   each with its stdin and stdout on pipes to the shell, that are sent a
+ *   line per request and answer each with a line, so a filter used on many
+ *   small inputs is executed once instead of once per input
+ * The shell's ends are non-blocking and close-on-exec, so no other command
+ *   keeps a worker's stdin open */
+#define MAX_POOLS 8
+#define MAX_WORKERS 64
+#define POOL_WINDOW 64     /* Requests a worker may have unanswered */
+typedef struct
+{
+   pid_t pid;              // 0 once a job reaper took its exit status
+   pid_t reaped;           // Then its pid, status and usage are kept for
+   int status;             //   stopPool() to log
+   struct rusage usage;
+   int toFd;               // Its stdin
+   int fromFd;             // Its stdout
+   long owed;              // Answers to requests of an interrupted coproc -s
+} Worker;
+typedef struct
+{
+   char name[32];          // "" for a free slot
+   char *command;          // As typed, for coproc with no arguments
+   double started;
+   int numWorkers;
+   Worker workers[MAX_WORKERS];
+} Pool;
+static Pool pools[MAX_POOLS];
+
+/* Bytes on their way to or from a worker, in coproc -s */
+typedef struct
+{
+   char *data;
+   size_t len;
+   size_t cap;
+} Bytes;
+
+
+/** ------------------------------- findPool ----------------------------------
+ * Returns the pool called name, or NULL if there's none
+ */
+static Pool *findPool(const char *name)
+{
+   for (int p = 0; p < MAX_POOLS; p++)
+   {
+      if (pools[p].name[0] != '\0' && strcmp(pools[p].name, name) == 0)
+      {
+         return &pools[p];
+      }
+   }
+   return NULL;
+}
+
+
+/** ----------------------------- workerReaped --------------------------------
+ * Keeps the exit status of pid if it's a coproc worker that one of the job
+ *   reapers took, so its pid (free for reuse now) is never signalled
+ */
+static void workerReaped(pid_t pid, int status, const struct rusage *usage)
+{
+   for (int p = 0; p < MAX_POOLS; p++)
+   {
+      for (int w = 0; pools[p].name[0] != '\0' && w < pools[p].numWorkers;
+           w++)
+      {
+         Worker *worker = &pools[p].workers[w];
+         if (worker->pid == pid)
+         {
+            worker->pid = 0;
+            worker->reaped = pid;
+            worker->status = status;
+            worker->usage = *usage;
+            return;
+         }
+      }
+   }
+}
+
+
+/** ------------------------------- bytesAdd ----------------------------------
+ * Appends len bytes of data to bytes, growing it as needed
+ */
+static void bytesAdd(Bytes *bytes, const char *data, size_t len)
+{
+   if (bytes->cap - bytes->len < len)
+   {
+      size_t cap = bytes->cap > 0 ? bytes->cap * 2 : 4096;
+      while (cap - bytes->len < len)
+      {
+         cap *= 2;
+      }
+      char *grown = realloc(bytes->data, cap);
+      if (grown == NULL)
+      {
+         perror("Out of memory");
+         exit(1);
+      }
+      bytes->data = grown;
+      bytes->cap = cap;
+   }
+   memcpy(bytes->data + bytes->len, data, len);
+   bytes->len += len;
+}
+
+
+/** ------------------------------- bytesDrop ---------------------------------
+ * Removes the first len bytes of bytes
+ */
+static void bytesDrop(Bytes *bytes, size_t len)
+{
+   memmove(bytes->data, bytes->data + len, bytes->len - len);
+   bytes->len -= len;
+}
+
+
+/** ------------------------------- startPool ---------------------------------
+ * Launches numWorkers copies of argv as the pool name, every one in a
+ *   process group of its own so ^C at the terminal doesn't reach them
+ * Returns 0, or 1 if not all of them could be started
+ */
+static int startPool(const char *name, int numWorkers, char **argv)
+{
+   Pool *pool = NULL;
+
+   for (int p = 0; p < MAX_POOLS && pool == NULL; p++)
+   {
+      if (pools[p].name[0] == '\0')
+      {
+         pool = &pools[p];
+      }
+   }
+   if (pool == NULL)
+   {
+      fprintf(stderr, "coproc: no room for another pool (%d)\n", MAX_POOLS);
+      return 1;
+   }
+
+   char text[256];
+   size_t len = 0;
+   text[0] = '\0';
+   for (int w = 0; argv[w] != NULL && len < sizeof(text); w++)
+   {
+      len += snprintf(text + len, sizeof(text) - len, w > 0 ? " %s" : "%s",
+                      argv[w]);
+   }
+
+   Stage st = { argv, NULL, 0, findBuiltin(argv[0]) == NULL
+                               ? lookupCommand(argv[0]) : NULL, NULL };
+   pool->numWorkers = 0;
+   pool->started = nowUsec();
+   fflush(stdout);
+   for (int w = 0; w < numWorkers; w++)
+   {
+      int pipes[2][2];                          // To the worker, from it
+      if (makePipe(pipes[0], 0) == -1)
+      {
+         perror("Pipe failed");
+         break;
+      }
+      if (makePipe(pipes[1], 0) == -1)
+      {
+         perror("Pipe failed");
+         closePipes(pipes, 1);
+         break;
+      }
+
+      pid_t pid = launchStage(&st, 0, pipes[0][READ], pipes[1][WRITE],
+                              pipes, 2);
+      close(pipes[0][READ]);
+      close(pipes[1][WRITE]);
+      if (pid < 0)
+      {
+         close(pipes[0][WRITE]);
+         close(pipes[1][READ]);
+         break;
+      }
+      setpgid(pid, pid);
+
+      Worker *worker = &pool->workers[pool->numWorkers++];
+      worker->pid = pid;
+      worker->reaped = 0;
+      worker->toFd = pipes[0][WRITE];
+      worker->fromFd = pipes[1][READ];
+      worker->owed = 0;
+      for (int f = 0; f < 2; f++)
+      {
+         int fd = f == 0 ? worker->toFd : worker->fromFd;
+         fcntl(fd, F_SETFD, FD_CLOEXEC);
+         fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      }
+   }
+   if (pool->numWorkers == 0)
+   {
+      return 1;
+   }
+
+   snprintf(pool->name, sizeof(pool->name), "%s", name);
+   pool->command = strdup(text);
+   return pool->numWorkers < numWorkers;
+}
+
+
+/** ------------------------------- stopPool ----------------------------------
+ * Closes the pipes of every worker of pool, which ends a filter reading
+ *   its stdin, sends them SIGTERM for any that don't read it, and reaps
+ *   them from the shell's side so the pool's name is free again
+ * Workers a job reaper already took are only logged, from what it kept
+ */
+static void stopPool(Pool *pool)
+{
+   for (int w = 0; w < pool->numWorkers; w++)
+   {
+      close(pool->workers[w].toFd);
+      close(pool->workers[w].fromFd);
+      if (pool->workers[w].pid != 0)
+      {
+         kill(pool->workers[w].pid, SIGTERM);
+      }
+   }
+   for (int w = 0; w < pool->numWorkers; w++)
+   {
+      Worker *worker = &pool->workers[w];
+      pid_t pid = 0;
+      while (worker->pid != 0
+             && (pid = wait4(worker->pid, &worker->status, 0,
+                             &worker->usage)) == -1 && errno == EINTR)
+      {
+      }
+      if (worker->pid == 0)
+      {
+         pid = worker->reaped;
+      }
+      if (pid > 0)
+      {
+         logUsage(pid, worker->status, pool->started, &worker->usage,
+                  pool->command);
+      }
+   }
+   free(pool->command);
+   pool->command = NULL;
+   pool->name[0] = '\0';
+}
+
+
+/** ------------------------------ sendRecords --------------------------------
+ * Sends records (or, if NULL, the lines read from stdin) to the workers of
+ *   pool round robin and prints an answer line for each in request order
+ * Requests are written ahead of the answers, up to POOL_WINDOW per worker,
+ *   and everything moves in one poll() loop, so the workers stay busy and
+ *   neither side blocks on a full pipe; a worker must answer every line
+ *   with one line and flush it (sed -u, jq --unbuffered, mawk -W interactive)
+ * stdin is read with read(), so give it a pipe or a redirect in a script
+ * Returns 0, 1 if a worker quit with requests unanswered, 130 after ^C
+ */
+static int sendRecords(Pool *pool, char **records)
+{
+   int n = pool->numWorkers;
+   Bytes input = { NULL, 0, 0 };               // Read but not handed out
+   Bytes toSend[n], answers[n];
+   long unanswered[n];
+   long numSent = 0, numAnswered = 0;
+   int inputDone = records != NULL;
+   int status = 0;
+
+   memset(toSend, 0, sizeof(toSend));
+   memset(answers, 0, sizeof(answers));
+   memset(unanswered, 0, sizeof(unanswered));
+   for (; records != NULL && *records != NULL; records++)
+   {
+      bytesAdd(&input, *records, strlen(*records));
+      bytesAdd(&input, "\n", 1);
+   }
+
+   void (*savedPipe)(int) = signal(SIGPIPE, SIG_IGN);   // EPIPE instead
+   fflush(stdout);
+   while (status == 0)
+   {
+      // Answers are printed in request order, ones owed to a coproc -s
+      //   that was interrupted are dropped first
+      for (int w = 0; w < n; w++)
+      {
+         char *end;
+         while (pool->workers[w].owed > 0 && answers[w].len > 0
+                && (end = memchr(answers[w].data, '\n', answers[w].len)))
+         {
+            bytesDrop(&answers[w], end - answers[w].data + 1);
+            pool->workers[w].owed--;
+         }
+      }
+      for (;;)
+      {
+         int w = numAnswered % n;
+         char *end = unanswered[w] > 0 && pool->workers[w].owed == 0
+                     && answers[w].len > 0
+                     ? memchr(answers[w].data, '\n', answers[w].len) : NULL;
+         if (end == NULL)
+         {
+            break;
+         }
+         fwrite(answers[w].data, 1, end - answers[w].data + 1, stdout);
+         bytesDrop(&answers[w], end - answers[w].data + 1);
+         unanswered[w]--;
+         numAnswered++;
+      }
+      fflush(stdout);
+
+      // Whole lines go out round robin while there's room in the window
+      for (;;)
+      {
+         int w = numSent % n;
+         char *end = input.len > 0 ? memchr(input.data, '\n', input.len)
+                                   : NULL;
+         if (end == NULL && inputDone && input.len > 0)
+         {
+            bytesAdd(&input, "\n", 1);          // A last line without one
+            continue;
+         }
+         if (end == NULL || unanswered[w] == POOL_WINDOW)
+         {
+            break;
+         }
+         bytesAdd(&toSend[w], input.data, end - input.data + 1);
+         bytesDrop(&input, end - input.data + 1);
+         unanswered[w]++;
+         numSent++;
+      }
+      if (inputDone && input.len == 0 && numAnswered == numSent)
+      {
+         break;
+      }
+
+      struct pollfd fds[2 * n + 1];
+      int which[2 * n + 1];                    // -1 stdin, w to, n + w from
+      int numFds = 0;
+      if (!inputDone
+          && (input.len == 0 || memchr(input.data, '\n', input.len) == NULL))
+      {
+         fds[numFds] = (struct pollfd){ STDIN_FILENO, POLLIN, 0 };
+         which[numFds++] = -1;
+      }
+      for (int w = 0; w < n; w++)
+      {
+         const Worker *worker = &pool->workers[w];
+         if (toSend[w].len > 0)
+         {
+            fds[numFds] = (struct pollfd){ worker->toFd, POLLOUT, 0 };
+            which[numFds++] = w;
+         }
+         if (unanswered[w] + worker->owed > 0)
+         {
+            fds[numFds] = (struct pollfd){ worker->fromFd, POLLIN, 0 };
+            which[numFds++] = n + w;
+         }
+      }
+      if (poll(fds, numFds, -1) == -1)
+      {
+         if (errno != EINTR)
+         {
+            perror("coproc");
+            status = 1;
+         }
+         else if (interrupted)
+         {
+            status = 130;
+         }
+         continue;
+      }
+
+      for (int f = 0; f < numFds && status == 0; f++)
+      {
+         if (fds[f].revents == 0)
+         {
+            continue;
+         }
+         int w = which[f] % n;
+         int pid = w < 0 ? 0 : pool->workers[w].pid != 0
+                   ? pool->workers[w].pid : pool->workers[w].reaped;
+         if (which[f] == -1 || which[f] >= n)   // Something to read
+         {
+            Bytes *into = which[f] == -1 ? &input : &answers[w];
+            char chunk[65536];
+            ssize_t got = read(fds[f].fd, chunk, sizeof(chunk));
+            if (got > 0)
+            {
+               bytesAdd(into, chunk, got);
+            }
+            else if (which[f] == -1 && (got == 0 || errno != EAGAIN))
+            {
+               inputDone = 1;
+            }
+            else if (got == 0 || (errno != EAGAIN && errno != EINTR))
+            {
+               fprintf(stderr, "coproc: %s: worker %d quit with %ld "
+                       "requests unanswered\n", pool->name, pid,
+                       unanswered[w]);
+               status = 1;
+            }
+            continue;
+         }
+
+         ssize_t wrote = write(fds[f].fd, toSend[w].data, toSend[w].len);
+         if (wrote > 0)
+         {
+            bytesDrop(&toSend[w], wrote);
+         }
+         else if (wrote == -1 && errno != EAGAIN && errno != EINTR)
+         {
+            fprintf(stderr, "coproc: %s: worker %d stopped reading\n",
+                    pool->name, pid);
+            status = 1;
+         }
+      }
+   }
+   signal(SIGPIPE, savedPipe);
+
+   for (int w = 0; w < n; w++)
+   {
+      // Answers still to come mustn't pass for the next call's, the ones
+      //   to requests never sent or already read aren't coming
+      pool->workers[w].owed += unanswered[w];
+      for (size_t c = 0; c < toSend[w].len; c++)
+      {
+         pool->workers[w].owed -= toSend[w].data[c] == '\n';
+      }
+      for (size_t c = 0; c < answers[w].len; c++)
+      {
+         pool->workers[w].owed -= answers[w].data[c] == '\n';
+      }
+      free(toSend[w].data);
+      free(answers[w].data);
+   }
+   free(input.data);
+   return status;
+}
+
+
+/** ----------------------------- builtinCoproc -------------------------------
+ * coproc [-n N] NAME cmd args...   starts N (default 1) copies of cmd as the
+ *                                  worker pool NAME
+ * coproc -s NAME [LINE]...         sends each LINE, or each line of stdin,
+ *                                  to NAME's workers and prints one answer
+ *                                  line per request, in order
+ * coproc -k NAME                   closes the pool and ends its workers
+ * coproc                           lists the pools
+ */
+static int builtinCoproc(char **args)
+{
+   if (args[1] == NULL)
+   {
+      for (int p = 0; p < MAX_POOLS; p++)
+      {
+         if (pools[p].name[0] != '\0')
+         {
+            printf("%-12s %2d x %s\n", pools[p].name, pools[p].numWorkers,
+                   pools[p].command != NULL ? pools[p].command : "");
+         }
+      }
+      return 0;
+   }
+
+   if (strcmp(args[1], "-s") == 0 || strcmp(args[1], "-k") == 0)
+   {
+      Pool *pool = args[2] != NULL ? findPool(args[2]) : NULL;
+      if (pool == NULL)
+      {
+         fprintf(stderr, "coproc: %s: no such pool\n",
+                 args[2] != NULL ? args[2] : "(none given)");
+         return 1;
+      }
+      if (args[1][1] == 'k')
+      {
+         stopPool(pool);
+         return 0;
+      }
+      return sendRecords(pool, args[3] != NULL ? &args[3] : NULL);
+   }
+
+   int numWorkers = 1;
+   int a = 1;
+   if (strcmp(args[a], "-n") == 0)
+   {
+      if (args[a + 1] == NULL || atoi(args[a + 1]) < 1
+          || atoi(args[a + 1]) > MAX_WORKERS)
+      {
+         fprintf(stderr, "coproc: -n needs a number from 1 to %d\n",
+                 MAX_WORKERS);
+         return 2;
+      }
+      numWorkers = atoi(args[a + 1]);
+      a += 2;
+   }
+   if (args[a] == NULL || args[a + 1] == NULL)
+   {
+      fprintf(stderr, "coproc: usage: coproc [-n N] NAME COMMAND [ARG]...\n"
+                      "       coproc -s NAME [LINE]...  |  coproc -k NAME\n");
+      return 2;
+   }
+   if (!validName(args[a], strlen(args[a]))
+       || strlen(args[a]) >= sizeof(pools[0].name))
+   {
+      fprintf(stderr, "coproc: bad pool name %s\n", args[a]);
+      return 2;
+   }
+   if (findPool(args[a]) != NULL)
+   {
+      fprintf(stderr, "coproc: %s is already running\n", args[a]);
+      return 1;
+   }
+   return startPool(args[a], numWorkers, args + a + 1);
+}
+
+
+/** ------------------------------ setLauncher --------------------------------
+ * Selects the launcher by name (fork, vfork or spawn)
+ * Returns 0 on success or -1 if the name isn't known
+ */
+static int setLauncher(const char *name)
+{
+   for (int l = LAUNCH_FORK; l <= LAUNCH_SPAWN; l++)
+   {
+      if (strcmp(name, launcherNames[l]) == 0)
+      {
+         launcher = l;
+         return 0;
+      }
+   }
+   return -1;
+}
+
+
+/** ------------------------------- parseSize ---------------------------------
+ * Reads a byte count with an optional K, M or G suffix, e.g. 1M
+ * Returns -1 if text isn't one, or is negative or too big for a long
+ */
+static long parseSize(const char *text)
+{
+   char *end;
+   int shift = 0;
+
+   errno = 0;
+   long size = strtol(text, &end, 10);
+   if (end == text || size < 0 || errno == ERANGE)
+   {
+      return -1;                    // Checked before it's scaled
+   }
+   switch (*end)
+   {
+      case 'k' : case 'K' : shift = 10; end++; break;
+      case 'm' : case 'M' : shift = 20; end++; break;
+      case 'g' : case 'G' : shift = 30; end++; break;
+   }
+   if (*end != '\0' || size > LONG_MAX >> shift)
+   {
+      return -1;
+   }
+   return size << shift;
+}
+
+
+/** ------------------------------ openAcctLog --------------------------------
+ * Starts appending to the accounting log file, or stops for "off"
+ * Returns 0, or -1 (after printing why) if the file can't be opened
+ */
+static int openAcctLog(const char *file)
+{
+   if (acctFd != -1)
+   {
+      close(acctFd);
+      acctFd = -1;
+   }
+   if (strcmp(file, "off") == 0)
+   {
+      return 0;
+   }
+
+   acctFd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+   if (acctFd == -1)
+   {
+      fprintf(stderr, "acctlog: %s: %s\n", file, strerror(errno));
+      return -1;
+   }
+   return 0;
+}
+
+
+/** ------------------------------ builtinSet ---------------------------------
+ * set                  prints the shell options
+ * set launcher=NAME    selects how commands are started
+ * set pipesize=SIZE    capacity for every pipe the shell makes (e.g. 1M),
+ *                      0 or default for the system's
+ * set edit=on|off      whether a terminal gets the line editor
+ * set acctlog=FILE     appends a line per finished child to FILE, off
+ *                      stops logging
+ * set trace=FILE       traces every phase of a command into FILE (JSON
+ *                      for a .json one), off stops tracing
+ * set cgroup=DIR       puts every job in a cgroup of its own under the
+ *                      cgroup v2 directory DIR, off for none
+ * set cpumax=N%        cpu.max of each job's cgroup, N% of one CPU
+ * set memmax=SIZE      memory.max of each job's cgroup (e.g. 512M)
+ * set cpus=LIST        pins every job to a CPU list like 0-3,6, spread
+ *                      gives each background job the next CPU in turn
+ *   cpumax, memmax and cpus take off too
+ */
+static int builtinSet(char **args)
+{
+   if (args[1] == NULL)
+   {
+      printf("launcher=%s\n", launcherNames[launcher]);
+      printf("edit=%s\n", editing ? "on" : "off");
+      printf("acctlog=%s\n", acctFd != -1 ? "on" : "off");
+      printf("trace=%s\n", traceFd != -1 ? "on" : "off");
+      printf("cgroup=%s\n", cgroupDir != NULL ? cgroupDir : "off");
+      if (cpuMaxPercent > 0)
+      {
+         printf("cpumax=%ld%%\n", cpuMaxPercent);
+      }
+      if (memMax > 0)
+      {
+         printf("memmax=%ld\n", memMax);
+      }
+      printf("cpus=%s\n", cpusMode == CPUS_LIST ? defaultCpusText
+                          : cpusMode == CPUS_SPREAD ? "spread" : "off");
+      if (pipeSize == 0)
+      {
+         printf("pipesize=default\n");
+      }
+      else if (lastPipeSize == 0)          // No pipe made yet
+      {
+         printf("pipesize=%ld\n", pipeSize);
+      }
+      else
+      {
+         printf("pipesize=%ld (last pipe got %ld)\n", pipeSize, lastPipeSize);
+      }
+      return 0;
+   }
+
+   int status = 0;
+   for (int a = 1; args[a] != NULL; a++)
+   {
+      if (strncmp(args[a], "launcher=", 9) == 0)
+      {
+         if (setLauncher(args[a] + 9) == -1)
+         {
+            fprintf(stderr, "set: unknown launcher %s "
+                            "(use fork, vfork or spawn)\n", args[a] + 9);
+            status = 1;
+         }
+      }
+      else if (strcmp(args[a], "edit=on") == 0
+               || strcmp(args[a], "edit=off") == 0)
+      {
+         editing = args[a][6] == 'n';
+      }
+      else if (strncmp(args[a], "acctlog=", 8) == 0)
+      {
+         if (openAcctLog(args[a] + 8) == -1)
+         {
+            status = 1;
+         }
+      }
+      else if (strncmp(args[a], "trace=", 6) == 0)
+      {
+         if (traceOpen(args[a] + 6) == -1)
+         {
+            status = 1;
+         }
+      }
+      else if (strncmp(args[a], "cgroup=", 7) == 0)
+      {
+         if (setCgroupDir(args[a] + 7) == -1)
+         {
+            status = 1;
+         }
+      }
+      else if (strncmp(args[a], "cpumax=", 7) == 0)
+      {
+         char *end;
+         long percent = strtol(args[a] + 7, &end, 10);
+         if (strcmp(args[a] + 7, "off") == 0)
+         {
+            cpuMaxPercent = 0;
+         }
+         else if (end == args[a] + 7 || strcmp(end, "%") != 0
+                  || percent <= 0 || percent > 100000)
+         {
+            fprintf(stderr, "set: bad cpumax %s (e.g. 50%%)\n", args[a] + 7);
+            status = 1;
+         }
+         else
+         {
+            cpuMaxPercent = percent;
+         }
+      }
+      else if (strncmp(args[a], "memmax=", 7) == 0)
+      {
+         long size = strcmp(args[a] + 7, "off") == 0
+                     ? 0 : parseSize(args[a] + 7);
+         if (size == -1)
+         {
+            fprintf(stderr, "set: bad memmax %s\n", args[a] + 7);
+            status = 1;
+         }
+         else
+         {
+            memMax = size;
+         }
+      }
+      else if (strncmp(args[a], "cpus=", 5) == 0)
+      {
+         const char *list = args[a] + 5;
+         if (strcmp(list, "off") == 0 || strcmp(list, "spread") == 0)
+         {
+            cpusMode = list[0] == 'o' ? CPUS_ANY : CPUS_SPREAD;
+         }
+         else if (parseCpus(list, &defaultCpus) == -1)
+         {
+            fprintf(stderr, "set: bad CPU list %s\n", list);
+            status = 1;
+         }
+         else
+         {
+            cpusMode = CPUS_LIST;
+            free(defaultCpusText);
+            defaultCpusText = strdup(list);
+         }
+      }
+      else if (strncmp(args[a], "pipesize=", 9) == 0)
+      {
+         long size = strcmp(args[a] + 9, "default") == 0
+                     ? 0 : parseSize(args[a] + 9);
+         if (size == -1 || size > INT_MAX)
+         {
+            fprintf(stderr, "set: bad pipe size %s\n", args[a] + 9);
+            status = 1;
+         }
+         else
+         {
+            pipeSize = size;
+         }
+      }
+      else
+      {
+         fprintf(stderr, "set: unknown option %s\n", args[a]);
+         status = 1;
+      }
+   }
+   return status;
+}
+
+
+/* Command history, entry n (counting from 1 over the life of the history
+ *   file) lives in histRing[n % HIST_MAX] while histFirst <= n < histNext
+ * Entries loaded from the history file point into its mmap()ed copy,
+ *   entries typed since are strdup()ed, neither is NUL terminated */
+#define HIST_MAX 65536        /* Entries kept, must be a power of 2 */
+#define HIST_DEPTH 8          /* Leading characters indexed by the trie */
+typedef struct
+{
+   const char *text;
+   int len;
+   int prev;               // Older entry ending at the same trie node, or 0
+} HistEntry;
+static HistEntry histRing[HIST_MAX];
+static int histFirst = 1;
+static int histNext = 1;
+
+/* Prefix trie over the first HIST_DEPTH characters of every entry
+ *   Node 0 is the root, children are a sibling list since few prefixes
+ *   branch much, each node knows its newest entry and the newest entry
+ *   that ends on it (the head of a prev list) */
+typedef struct
+{
+   char c;
+   int child;              // First child node, 0 = none
+   int sibling;            // Next child of the same parent, 0 = none
+   int latest;             // Newest entry with this prefix
+   int last;               // Newest entry indexed no deeper than this node
+} TrieNode;
+static TrieNode *trie = NULL;
+static int trieSize = 0;
+static int trieCapacity = 0;
+
+/* The history file, mapped at startup but only read the first time the
+ *   history is used */
+static int histFd = -1;
+static const char *histMap = NULL;
+static size_t histMapLen = 0;
+static int histLoaded = 0;
+
+
+/** ------------------------------- trieChild ---------------------------------
+ * Finds node's child for character c, adding it if add is set
+ * Returns its index, or 0 if there's none
+ */
+static int trieChild(int node, char c, int add)
+{
+   for (int n = trie[node].child; n != 0; n = trie[n].sibling)
+   {
+      if (trie[n].c == c)
+      {
+         return n;
+      }
+   }
+   if (!add)
+   {
+      return 0;
+   }
+
+   if (trieSize == trieCapacity)
+   {
+      trieCapacity = trieCapacity > 0 ? trieCapacity * 2 : 1024;
+      trie = realloc(trie, trieCapacity * sizeof(TrieNode));
+      if (trie == NULL)
+      {
+         perror("History index");
+         exit(1);
+      }
+   }
+   int child = trieSize++;
+   trie[child] = (TrieNode){ c, 0, trie[node].child, 0, 0 };
+   trie[node].child = child;
+   return child;
+}
+
+
+/** ----------------------------- historyInsert -------------------------------
+ * Adds an entry to the ring and the prefix trie, dropping the oldest entry
+ *   once the ring is full
+ */
+static void historyInsert(const char *text, int len)
+{
+   if (histNext - histFirst == HIST_MAX)
+   {
+      HistEntry *old = &histRing[histFirst % HIST_MAX];
+      if (old->text < histMap || old->text >= histMap + histMapLen)
+      {
+         free((char *)old->text);             // Not in the mapped file
+      }
+      histFirst++;
+   }
+
+   if (trie == NULL)                          // Make the root
+   {
+      trieCapacity = 1024;
+      trie = calloc(trieCapacity, sizeof(TrieNode));
+      if (trie == NULL)
+      {
+         perror("History index");
+         exit(1);
+      }
+      trieSize = 1;
+   }
+
+   int n = histNext++;
+   int node = 0;
+   trie[0].latest = n;
+   for (int c = 0; c < len && c < HIST_DEPTH; c++)
+   {
+      node = trieChild(node, text[c], 1);
+      trie[node].latest = n;
+   }
+   histRing[n % HIST_MAX] = (HistEntry){ text, len, trie[node].last };
+   trie[node].last = n;
+}
+
+
+/** ------------------------------ historyOpen --------------------------------
+ * Opens the history file ($OSH_HISTFILE, default ~/.osh_history) for
+ *   appending and maps what's already in it, without reading it
+ */
+static void historyOpen(void)
+{
+   char path[PATH_MAX];
+   const char *file = getVar("OSH_HISTFILE");
+   const char *home = getVar("HOME");
+
+   if (file == NULL && home == NULL)
+   {
+      return;
+   }
+   if (file == NULL)
+   {
+      snprintf(path, sizeof(path), "%s/.osh_history", home);
+      file = path;
+   }
+
+   histFd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+   struct stat info;
+   if (histFd == -1 || fstat(histFd, &info) == -1)
+   {
+      perror(file);
+      return;
+   }
+   if (info.st_size > 0)
+   {
+      void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, histFd, 0);
+      if (map != MAP_FAILED)
+      {
+         histMap = map;
+         histMapLen = info.st_size;
+      }
+   }
+}
+
+
+/** ------------------------------ historyLoad --------------------------------
+ * Indexes the mapped history file the first time the history is needed
+ * Only the last HIST_MAX lines are looked at, found by walking back from
+ *   the end of the file, so the cost doesn't grow with the file
+ */
+static void historyLoad(void)
+{
+   if (histLoaded)
+   {
+      return;
+   }
+   histLoaded = 1;
+
+   const char *start = histMap + histMapLen;
+   int numLines = 0;
+   while (start > histMap && numLines < HIST_MAX)
+   {
+      const char *end = start - 1;             // The \n ending a line
+      const char *nl = memrchr(histMap, '\n', end - histMap);
+      start = nl != NULL ? nl + 1 : histMap;
+      numLines++;
+   }
+   for (const char *line = start; line < histMap + histMapLen; )
+   {
+      const char *end = memchr(line, '\n', histMap + histMapLen - line);
+      if (end == NULL)
+      {
+         end = histMap + histMapLen;
+      }
+      if (end > line)
+      {
+         historyInsert(line, (int)(end - line));
+      }
+      line = end + 1;
+   }
+}
+
+
+/** ------------------------------ historyAdd ---------------------------------
+ * Remembers a command and appends it to the history file
+ */
+static void historyAdd(const char *line)
+{
+   size_t len = strlen(line);
+   char *copy = malloc(len + 1);
+
+   historyLoad();                              // Keep the numbering right
+   if (copy == NULL)
+   {
+      return;
+   }
+   memcpy(copy, line, len);
+   copy[len] = '\n';                          // Written out as it's stored
+   historyInsert(copy, (int)len);
+
+   if (histFd != -1 && write(histFd, copy, len + 1) == -1)
+   {
+      perror("History file");
+      close(histFd);
+      histFd = -1;
+   }
+}
+
+
+/** ------------------------------ historyFind --------------------------------
+ * Finds the newest entry starting with prefix through the trie, only
+ *   prefixes longer than HIST_DEPTH have to compare entries
+ * Returns its number, or 0 if there's none
+ */
+static int historyFind(const char *prefix)
+{
+   int len = (int)strlen(prefix);
+   int node = 0;
+
+   if (trie == NULL)
+   {
+      return 0;
+   }
+   for (int c = 0; c < len && c < HIST_DEPTH; c++)
+   {
+      node = trieChild(node, prefix[c], 0);
+      if (node == 0)
+      {
+         return 0;
+      }
+   }
+
+   if (len <= HIST_DEPTH)
+   {
+      return trie[node].latest >= histFirst ? trie[node].latest : 0;
+   }
+
+   // Every entry this long ends on the same node, newest first
+   for (int n = trie[node].last; n >= histFirst;
+        n = histRing[n % HIST_MAX].prev)
+   {
+      const HistEntry *entry = &histRing[n % HIST_MAX];
+      if (entry->len >= len && memcmp(entry->text, prefix, len) == 0)
+      {
+         return n;
+      }
+   }
+   return 0;
+}
+
+
+/** ----------------------------- historyRecall -------------------------------
+ * Turns a history reference into the command it names, copied into arena
+ *   !!        the last command
+ *   !n        command number n
+ *   !-n       the nth last command
+ *   !prefix   the last command starting with prefix
+ * Returns NULL (after printing why) if there's no such command
+ */
+static char *historyRecall(Arena *arena, const char *ref)
+{
+   int n = 0;
+
+   historyLoad();
+   if (strcmp(ref, "!!") == 0)
+   {
+      n = histNext - 1;
+      if (n < histFirst)
+      {
+         printf("No command in history.\n");
+         return NULL;
+      }
+   }
+   else if ((ref[1] >= '0' && ref[1] <= '9')
+            || (ref[1] == '-' && ref[2] >= '0' && ref[2] <= '9'))
+   {
+      char *end;
+      long number = strtol(ref + 1, &end, 10);
+      n = *end != '\0' ? 0 : number < 0 ? histNext + (int)number
+                                         : (int)number;
+   }
+   else
+   {
+      n = historyFind(ref + 1);
+   }
+
+   if (n < histFirst || n >= histNext)
+   {
+      fprintf(stderr, "osh: %s: event not found\n", ref);
+      return NULL;
+   }
+   const HistEntry *entry = &histRing[n % HIST_MAX];
+   return arenaStrndup(arena, entry->text, entry->len);
+}
+
+
+/** ----------------------------- builtinHistory ------------------------------
+ * history        lists every remembered command with its number
+ * history N      lists the last N
+ */
+static int builtinHistory(char **args)
+{
+   historyLoad();
+   int from = histFirst;
+   if (args[1] != NULL)
+   {
+      char *end;
+      long count = strtol(args[1], &end, 10);
+      if (end == args[1] || *end != '\0' || count < 0)
+      {
+         fprintf(stderr, "history: %s: numeric argument required\n",
+                 args[1]);
+         return 2;
+      }
+      if (count < histNext - histFirst)
+      {
+         from = histNext - (int)count;
+      }
+   }
+
+   for (int n = from; n < histNext; n++)
+   {
+      const HistEntry *entry = &histRing[n % HIST_MAX];
+      printf("%5d  %.*s\n", n, entry->len, entry->text);
+   }
+   return 0;
+}
+
+
+/* Line editor for interactive input, reads keys itself in raw mode
+ *   The terminal line is assumed to be a single row of one cell per byte,
+ *   a line wider than the terminal scrolls sideways under the cursor */
+enum
+{
+   KEY_LEFT = 1000, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_HOME, KEY_END, KEY_DEL,
+   KEY_OTHER,          // An escape sequence the editor doesn't use
+   KEY_JOBS            // Not a key, a job to report came first
+};
+#define CTRL_KEY(c) ((c) & 0x1f)
+
+typedef struct
+{
+   char *buf;              // Text being edited, NUL terminated
+   size_t cap;
+   size_t len;
+   size_t pos;             // Cursor, 0 to len
+   char *shown;            // What the terminal row shows right now
+   size_t shownLen;
+   size_t shownCap;
+   size_t column;          // Where the terminal's cursor is on that row
+   size_t offset;          // First character of prompt + text that's shown
+   size_t width;           // Usable columns
+} Editor;
+
+
+/** ------------------------------- editGrow ----------------------------------
+ * Makes room for at least need bytes in *buf
+ */
+static void editGrow(char **buf, size_t *cap, size_t need)
+{
+   if (need <= *cap)
+   {
+      return;
+   }
+   size_t newCap = *cap > 0 ? *cap : 128;
+   while (newCap < need)
+   {
+      newCap *= 2;
+   }
+   char *grown = realloc(*buf, newCap);
+   if (grown == NULL)
+   {
+      perror("Line editor");
+      exit(1);
+   }
+   *buf = grown;
+   *cap = newCap;
+}
+
+
+/** ------------------------------ editRefresh --------------------------------
+ * Brings the terminal row up to date with prompt + text, cursor at pos
+ * Only the cells from the first difference with what's already shown are
+ *   sent, so typing at the end of a line costs one byte and a repaint is
+ *   one write() however it was reached
+ */
+static void editRefresh(Editor *ed, const char *prompt, const char *text,
+                        size_t len, size_t pos)
+{
+   size_t promptLen = strlen(prompt);
+   size_t total = promptLen + len;
+   size_t cursor = promptLen + pos;
+
+   if (cursor < ed->offset)                   // Scroll to keep it in view
+   {
+      ed->offset = cursor;
+   }
+   if (cursor >= ed->offset + ed->width)
+   {
+      ed->offset = cursor - ed->width + 1;
+   }
+   if (total <= ed->width)
+   {
+      ed->offset = 0;
+   }
+
+   // The visible slice of prompt + text
+   size_t viewLen = total - ed->offset < ed->width ? total - ed->offset
+                                                   : ed->width;
+   char view[viewLen + 1];
+   for (size_t v = 0; v < viewLen; v++)
+   {
+      size_t at = ed->offset + v;
+      view[v] = at < promptLen ? prompt[at] : text[at - promptLen];
+   }
+
+   size_t same = 0;
+   while (same < viewLen && same < ed->shownLen
+          && view[same] == ed->shown[same])
+   {
+      same++;
+   }
+
+   char out[viewLen + 64];
+   size_t n = 0;
+   if (ed->column > same)                      // Back to the difference
+   {
+      n += ed->column - same <= 4
+           ? (size_t)sprintf(out + n, "%.*s", (int)(ed->column - same),
+                             "\b\b\b\b")
+           : (size_t)sprintf(out + n, "\x1b[%zuD", ed->column - same);
+   }
+   else if (ed->column < same)                 // Rewriting cells is cheap
+   {
+      memcpy(out + n, view + ed->column, same - ed->column);
+      n += same - ed->column;
+   }
+   memcpy(out + n, view + same, viewLen - same);
+   n += viewLen - same;
+   if (ed->shownLen > viewLen)                 // Clear what's left over
+   {
+      n += sprintf(out + n, "\x1b[K");
+   }
+
+   size_t target = cursor - ed->offset;
+   if (viewLen - target <= 4)
+   {
+      n += sprintf(out + n, "%.*s", (int)(viewLen - target), "\b\b\b\b");
+   }
+   else
+   {
+      n += sprintf(out + n, "\x1b[%zuD", viewLen - target);
+   }
+
+   if (n > 0)
+   {
+      write(STDOUT_FILENO, out, n);
+   }
+   editGrow(&ed->shown, &ed->shownCap, viewLen + 1);
+   memcpy(ed->shown, view, viewLen);
+   ed->shownLen = viewLen;
+   ed->column = target;
+}
+
+
+/** ------------------------------ editForget ---------------------------------
+ * Forgets what the row shows once the cursor was moved to a fresh line
+ *   (after a completion list or a clear screen)
+ */
+static void editForget(Editor *ed)
+{
+   ed->shownLen = 0;
+   ed->column = 0;
+}
+
+
+/** -------------------------------- readKey ----------------------------------
+ * Reads one key, turning the arrow, Home, End and Delete escape sequences
+ *   into KEY_ codes
+ * Returns the key, KEY_JOBS if a background job finished or stopped
+ *   first, or -1 at end of input (or once TMOUT ran out)
+ */
+static int readKey(void)
+{
+   unsigned char c;
+   ssize_t got;
+
+   int ready = waitInput(STDIN_FILENO, 1);
+   if (ready != 1)
+   {
+      return ready == 0 ? KEY_JOBS : -1;
+   }
+   while ((got = read(STDIN_FILENO, &c, 1)) == -1 && errno == EINTR)
+   {
+   }
+   if (got != 1)
+   {
+      return -1;
+   }
+   if (c != 0x1b)
+   {
+      return c;
+   }
+
+   // A lone Esc has nothing right behind it
+   struct pollfd pending = { STDIN_FILENO, POLLIN, 0 };
+   unsigned char seq[8];
+   if (poll(&pending, 1, 50) != 1 || read(STDIN_FILENO, seq, 1) != 1)
+   {
+      return 0x1b;
+   }
+   if (seq[0] != '[' && seq[0] != 'O')
+   {
+      return KEY_OTHER;
+   }
+
+   size_t len = 0;                             // Parameters and final byte
+   while (len < sizeof(seq) && read(STDIN_FILENO, &seq[len], 1) == 1)
+   {
+      if (seq[len++] >= 0x40)
+      {
+         break;
+      }
+   }
+   switch (len > 0 ? seq[len - 1] : 0)
+   {
+      case 'A' : return KEY_UP;
+      case 'B' : return KEY_DOWN;
+      case 'C' : return KEY_RIGHT;
+      case 'D' : return KEY_LEFT;
+      case 'H' : return KEY_HOME;
+      case 'F' : return KEY_END;
+      case '~' :
+         switch (seq[0])
+         {
+            case '1' : case '7' : return KEY_HOME;
+            case '4' : case '8' : return KEY_END;
+            case '3' : return KEY_DEL;
+         }
+   }
+   return KEY_OTHER;
+}
+
+
+/** ------------------------------ editReplace --------------------------------
+ * Replaces the len bytes at the cursor with text, leaving the cursor after
+ *   it
+ */
+static void editReplace(Editor *ed, size_t len, const char *text,
+                        size_t textLen)
+{
+   editGrow(&ed->buf, &ed->cap, ed->len - len + textLen + 1);
+   memmove(ed->buf + ed->pos + textLen, ed->buf + ed->pos + len,
+           ed->len - ed->pos - len + 1);
+   memcpy(ed->buf + ed->pos, text, textLen);
+   ed->len = ed->len - len + textLen;
+   ed->pos += textLen;
+}
+
+
+/** ----------------------------- editSetText ---------------------------------
+ * Replaces the whole line, cursor at the end
+ */
+static void editSetText(Editor *ed, const char *text, size_t len)
+{
+   ed->pos = 0;
+   editReplace(ed, ed->len, text, len);
+}
+
+
+/** ---------------------------- historySearch --------------------------------
+ * Finds the newest entry no newer than from that contains query
+ * Returns its number, or 0 if there's none
+ */
+static int historySearch(const char *query, size_t len, int from)
+{
+   for (int n = from < histNext ? from : histNext - 1; n >= histFirst; n--)
+   {
+      const HistEntry *entry = &histRing[n % HIST_MAX];
+      if (memmem(entry->text, entry->len, query, len) != NULL)
+      {
+         return n;
+      }
+   }
+   return 0;
+}
+
+
+/** ---------------------------- reverseSearch --------------------------------
+ * Ctrl-R: searches back through the history while a query is typed,
+ *   Ctrl-R again moves to the next older match
+ * Enter or any editing key takes the match into the line, Ctrl-G or
+ *   Ctrl-C leaves the line as it was
+ * Returns the key that ended the search for editLine() to act on, or 0
+ */
+static int reverseSearch(Editor *ed)
+{
+   char query[256];
+   size_t queryLen = 0;
+   int match = 0;
+   int failed = 0;
+
+   historyLoad();
+   for (;;)
+   {
+      const HistEntry *entry = match != 0 ? &histRing[match % HIST_MAX]
+                                          : NULL;
+      const char *hit = entry != NULL
+                        ? memmem(entry->text, entry->len, query, queryLen)
+                        : NULL;
+      char prompt[sizeof(query) + 32];
+      snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ",
+               failed ? "failed " : "", (int)queryLen, query);
+      editRefresh(ed, prompt, entry != NULL ? entry->text : "",
+                  entry != NULL ? (size_t)entry->len : 0,
+                  hit != NULL ? (size_t)(hit - entry->text) : 0);
+
+      int key = readKey();
+      if (key == KEY_JOBS)                         // Reported after it
+      {
+         continue;
+      }
+      if (key == CTRL_KEY('r'))                    // Next older match
+      {
+         int older = match > histFirst
+                     ? historySearch(query, queryLen, match - 1) : 0;
+         failed = older == 0;
+         match = older != 0 ? older : match;
+      }
+      else if (key == 127 || key == CTRL_KEY('h'))
+      {
+         queryLen -= queryLen > 0;
+         match = historySearch(query, queryLen, histNext - 1);
+         failed = match == 0;
+      }
+      else if (key >= ' ' && key < 256 && key != 127)
+      {
+         if (queryLen < sizeof(query))
+         {
+            query[queryLen++] = (char)key;
+         }
+         int found = historySearch(query, queryLen,
+                                   match != 0 ? match : histNext - 1);
+         failed = found == 0;
+         match = found != 0 ? found : match;
+      }
+      else if (key == CTRL_KEY('g') || key == CTRL_KEY('c'))
+      {
+         return 0;
+      }
+      else                                     // Keep the match
+      {
+         if (match != 0)
+         {
+            editSetText(ed, entry->text, entry->len);
+         }
+         return key;
+      }
+   }
+}
+
+
+/** ------------------------------ completions --------------------------------
+ * Collects the names in directory dir (the current one for "") starting
+ *   with base, directories get a trailing /
+ * Returns how many, *names is a malloc()ed array of malloc()ed strings
+ */
+static int completions(const char *dir, const char *base, char ***names)
+{
+   size_t baseLen = strlen(base);
+   int count = 0;
+   int capacity = 0;
+   DIR *d = opendir(dir[0] != '\0' ? dir : ".");
+
+   *names = NULL;
+   for (struct dirent *ent; d != NULL && (ent = readdir(d)) != NULL; )
+   {
+      if (strncmp(ent->d_name, base, baseLen) != 0
+          || (ent->d_name[0] == '.' && base[0] != '.')
+          || strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      {
+         continue;
+      }
+
+      int isDir = ent->d_type == DT_DIR;
+      if (ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN)
+      {
+         char path[PATH_MAX];
+         struct stat info;
+         snprintf(path, sizeof(path), "%s%s", dir, ent->d_name);
+         isDir = stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+      }
+
+      if (count == capacity)
+      {
+         capacity = capacity > 0 ? capacity * 2 : 16;
+         *names = realloc(*names, capacity * sizeof(char *));
+      }
+      size_t len = strlen(ent->d_name);
+      char *name = malloc(len + 2);
+      memcpy(name, ent->d_name, len);
+      strcpy(name + len, isDir ? "/" : "");
+      (*names)[count++] = name;
+   }
+   if (d != NULL)
+   {
+      closedir(d);
+   }
+   return count;
+}
+
+
+/** ---------------------------- compareStrings -------------------------------
+ * qsort() order for completion lists
+ */
+static int compareStrings(const void *a, const void *b)
+{
+   return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+/* Index of the executables in every PATH directory for Tab completion
+ *   Built the first time a command name is completed, after that a
+ *   directory is only read again when its mtime says its entries changed */
+typedef struct
+{
+   char *dir;
+   struct timespec mtime;  // When it was read, 0 = not read yet
+   char **names;           // Sorted
+   int count;
+} ExecDir;
+static ExecDir *execDirs = NULL;
+static int numExecDirs = 0;
+static unsigned long indexedVersion = 0;  // pathVersion they came from
+
+
+/** ----------------------------- scanExecDir ---------------------------------
+ * (Re)reads one PATH directory, keeping the files anyone can execute
+ */
+static void scanExecDir(ExecDir *ed)
+{
+   struct stat info;
+   int capacity = 0;
+
+   for (int n = 0; n < ed->count; n++)
+   {
+      free(ed->names[n]);
+   }
+   free(ed->names);
+   ed->names = NULL;
+   ed->count = 0;
+
+   DIR *d = opendir(ed->dir);
+   if (d == NULL || fstat(dirfd(d), &info) == -1)
+   {
+      ed->mtime = (struct timespec){ 0, 0 };
+      if (d != NULL)
+      {
+         closedir(d);
+      }
+      return;
+   }
+   ed->mtime = info.st_mtim;
+
+   for (struct dirent *ent; (ent = readdir(d)) != NULL; )
+   {
+      if (ent->d_name[0] == '.' || (ent->d_type != DT_REG
+                                    && ent->d_type != DT_LNK
+                                    && ent->d_type != DT_UNKNOWN))
+      {
+         continue;
+      }
+      if (fstatat(dirfd(d), ent->d_name, &info, 0) == -1
+          || !S_ISREG(info.st_mode) || (info.st_mode & 0111) == 0)
+      {
+         continue;
+      }
+
+      if (ed->count == capacity)
+      {
+         capacity = capacity > 0 ? capacity * 2 : 64;
+         ed->names = realloc(ed->names, capacity * sizeof(char *));
+      }
+      ed->names[ed->count++] = strdup(ent->d_name);
+   }
+   closedir(d);
+   qsort(ed->names, ed->count, sizeof(char *), compareStrings);
+}
+
+
+/** ---------------------------- refreshExecIndex -----------------------------
+ * Brings the executable index up to date, splitting PATH again if it
+ *   changed and rereading only the directories whose mtime moved
+ */
+static void refreshExecIndex(void)
+{
+   const char *pathVar = getVar("PATH");
+
+   if (pathVar == NULL)
+   {
+      pathVar = "";
+   }
+   if (indexedVersion != pathVersion)
+   {
+      for (int d = 0; d < numExecDirs; d++)
+      {
+         for (int n = 0; n < execDirs[d].count; n++)
+         {
+            free(execDirs[d].names[n]);
+         }
+         free(execDirs[d].names);
+         free(execDirs[d].dir);
+      }
+      free(execDirs);
+      indexedVersion = pathVersion;
+
+      numExecDirs = 1;
+      for (const char *c = pathVar; *c != '\0'; c++)
+      {
+         numExecDirs += *c == ':';
+      }
+      execDirs = calloc(numExecDirs, sizeof(ExecDir));
+      const char *dir = pathVar;
+      for (int d = 0; d < numExecDirs; d++)
+      {
+         size_t len = strcspn(dir, ":");
+         execDirs[d].dir = len > 0 ? strndup(dir, len) : strdup(".");
+         dir += len + (dir[len] == ':');
+      }
+   }
+
+   for (int d = 0; d < numExecDirs; d++)
+   {
+      struct stat info;
+      ExecDir *ed = &execDirs[d];
+      int exists = stat(ed->dir, &info) == 0;
+
+      if (!exists && ed->mtime.tv_sec == 0 && ed->names == NULL)
+      {
+         continue;                               // Still not there
+      }
+      if (!exists || info.st_mtim.tv_sec != ed->mtime.tv_sec
+          || info.st_mtim.tv_nsec != ed->mtime.tv_nsec)
+      {
+         scanExecDir(ed);
+      }
+   }
+}
+
+
+/** ---------------------------- commandNames ---------------------------------
+ * Collects the builtins and PATH executables starting with prefix, each
+ *   name once
+ * Returns how many, *names is a malloc()ed array of malloc()ed strings
+ */
+static int commandNames(const char *prefix, char ***names)
+{
+   size_t len = strlen(prefix);
+   int count = 0;
+   int capacity = 16;
+
+   int numBuiltins = 0;
+   while (builtinName(numBuiltins) != NULL)
+   {
+      numBuiltins++;
+   }
+   const char *builtinNames[numBuiltins];
+   for (int b = 0; b < numBuiltins; b++)
+   {
+      builtinNames[b] = builtinName(b);
+   }
+
+   refreshExecIndex();
+   *names = malloc(capacity * sizeof(char *));
+   for (int d = -1; d < numExecDirs; d++)
+   {
+      // d == -1 is the builtin table, which is sorted too
+      char **list = NULL;
+      int listLen = 0;
+      if (d == -1)
+      {
+         list = (char **)builtinNames;
+         listLen = numBuiltins;
+      }
+      else
+      {
+         list = execDirs[d].names;
+         listLen = execDirs[d].count;
+      }
+
+      // Binary search for the first name >= prefix, the matches follow it
+      int low = 0;
+      int high = listLen;
+      while (low < high)
+      {
+         int mid = (low + high) / 2;
+         if (strcmp(list[mid], prefix) < 0)
+         {
+            low = mid + 1;
+         }
+         else
+         {
+            high = mid;
+         }
+      }
+      for (int n = low; n < listLen && strncmp(list[n], prefix, len) == 0;
+           n++)
+      {
+         if (count == capacity)
+         {
+            capacity *= 2;
+            *names = realloc(*names, capacity * sizeof(char *));
+         }
+         (*names)[count++] = strdup(list[n]);
+      }
+   }
+
+   // The same name can be in several directories
+   qsort(*names, count, sizeof(char *), compareStrings);
+   int unique = 0;
+   for (int n = 0; n < count; n++)
+   {
+      if (unique > 0 && strcmp((*names)[unique - 1], (*names)[n]) == 0)
+      {
+         free((*names)[n]);
+         continue;
+      }
+      (*names)[unique++] = (*names)[n];
+   }
+   return unique;
+}
+
+
+/** ------------------------------ listNames ----------------------------------
+ * Prints completion candidates in columns below the line
+ */
+static void listNames(Editor *ed, char **names, int count)
+{
+   size_t longest = 0;
+
+   qsort(names, count, sizeof(char *), compareStrings);
+   for (int n = 0; n < count; n++)
+   {
+      size_t len = strlen(names[n]);
+      longest = len > longest ? len : longest;
+   }
+
+   int perRow = (int)((ed->width + 1) / (longest + 2));
+   perRow = perRow > 0 ? perRow : 1;
+   printf("\n");
+   for (int n = 0; n < count; n++)
+   {
+      printf("%-*s", (n + 1) % perRow == 0 || n == count - 1
+                     ? 0 : (int)longest + 2, names[n]);
+      if ((n + 1) % perRow == 0 || n == count - 1)
+      {
+         printf("\n");
+      }
+   }
+   fflush(stdout);
+   editForget(ed);
+}
+
+
+/** ---------------------------- commandPosition ------------------------------
+ * Whether a word starting at buf[at] is a command name: it's first on the
+ *   line or comes after | ; & && || or a newline, or after a keyword that
+ *   is followed by a command (then, do, else, !...) and is one itself
+ */
+static int commandPosition(const char *buf, size_t at)
+{
+   static const char *const keywords[] =
+   {
+      "!", "do", "elif", "else", "if", "then", "until", "while",
+   };
+
+   while (at > 0 && (buf[at - 1] == ' ' || buf[at - 1] == '\t'))
+   {
+      at--;
+   }
+   if (at == 0 || strchr("|;\n", buf[at - 1]) != NULL)
+   {
+      return 1;
+   }
+   if (buf[at - 1] == '&')                // Not the >& or <& of a dup
+   {
+      return at < 2 || (buf[at - 2] != '>' && buf[at - 2] != '<');
+   }
+
+   size_t start = at;
+   while (start > 0 && strchr(" \t|<>&;\n", buf[start - 1]) == NULL)
+   {
+      start--;
+   }
+   for (size_t k = 0; k < sizeof(keywords) / sizeof(keywords[0]); k++)
+   {
+      if (strlen(keywords[k]) == at - start
+          && memcmp(buf + start, keywords[k], at - start) == 0)
+      {
+         return commandPosition(buf, start);
+      }
+   }
+   return 0;
+}
+
+
+/** ------------------------------ editComplete -------------------------------
+ * Tab: completes the word before the cursor, as far as every match agrees,
+ *   a second Tab in a row lists the matches
+ * A command name (without a /, see commandPosition()) completes to a
+ *   builtin or a command on PATH, anything else, redirect targets
+ *   included, to a file
+ * Special characters in what's inserted are escaped with a backslash
+ */
+static void editComplete(Editor *ed, int again)
+{
+   size_t start = ed->pos;
+   while (start > 0 && strchr(" \t|<>&;\n", ed->buf[start - 1]) == NULL)
+   {
+      start--;
+   }
+
+   // Split the word into the directory to look in and the name's start
+   char word[ed->pos - start + 1];
+   memcpy(word, ed->buf + start, ed->pos - start);
+   word[ed->pos - start] = '\0';
+   char *slash = strrchr(word, '/');
+   const char *base = slash != NULL ? slash + 1 : word;
+   char dir[sizeof(word) + 1];
+   snprintf(dir, sizeof(dir), "%.*s", slash != NULL ? (int)(base - word) : 0,
+            word);
+
+   int isCommand = slash == NULL && commandPosition(ed->buf, start);
+
+   char **names;
+   int count = isCommand ? commandNames(word, &names)
+                         : completions(dir, base, &names);
+   size_t baseLen = strlen(base);
+   size_t common = count > 0 ? strlen(names[0]) : 0;
+   for (int n = 1; n < count; n++)
+   {
+      size_t same = 0;
+      while (same < common && names[n][same] == names[0][same])
+      {
+         same++;
+      }
+      common = same;
+   }
+
+   if (count == 0)
+   {
+      write(STDOUT_FILENO, "\a", 1);
+   }
+   else if (common > baseLen || count == 1)   // Add what every match shares
+   {
+      char insert[2 * (common - baseLen) + 2];
+      size_t len = 0;
+      for (size_t c = baseLen; c < common; c++)
+      {
+         if (strchr(" \t\\'\"|&<>#;", names[0][c]) != NULL)
+         {
+            insert[len++] = '\\';
+         }
+         insert[len++] = names[0][c];
+      }
+      if (count == 1 && names[0][common - 1] != '/')
+      {
+         insert[len++] = ' ';                 // A finished word
+      }
+      editReplace(ed, 0, insert, len);
+   }
+   else if (again)
+   {
+      listNames(ed, names, count);
+   }
+
+   for (int n = 0; n < count; n++)
+   {
+      free(names[n]);
+   }
+   free(names);
+}
+
+
+/** ------------------------------- editLine ----------------------------------
+ * Reads one line from the terminal in raw mode, with the editing keys
+ *   Left/Right ^B/^F    move, Home/End ^A/^E to the ends
+ *   Backspace, Del ^D   delete a character, ^U ^K ^W delete to the start,
+ *                       to the end, a word back
+ *   Up/Down ^P/^N       step through the history
+ *   ^R                  incremental reverse history search
+ *   Tab                 complete a command or file name
+ *   ^C                  drop the line, ^L clear the screen
+ * The line is put in *line (grown as needed, without the \n)
+ * Returns its length, or -1 for ^D on an empty line or end of input
+ */
+static ssize_t editLine(const char *prompt, char **line, size_t *lineSize)
+{
+   struct termios cooked, raw;
+   struct winsize size;
+   Editor ed = { NULL, 0, 0, 0, NULL, 0, 0, 0, 0, 80 };
+   char *pending = NULL;                      // The new line while browsing
+   int browse = histNext;                     // Entry being shown
+   int lastKey = 0;
+   ssize_t result = -1;
+
+   if (tcgetattr(STDIN_FILENO, &cooked) == -1)
+   {
+      printf("%s", prompt);
+      fflush(stdout);
+      return getline(line, lineSize, stdin);
+   }
+   raw = cooked;
+   raw.c_iflag &= ~(ICRNL | IXON | BRKINT | ISTRIP | INPCK);
+   raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+   raw.c_cc[VMIN] = 1;
+   raw.c_cc[VTIME] = 0;
+   tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 1)
+   {
+      ed.width = size.ws_col - 1;             // Never write the last column
+   }
+   editGrow(&ed.buf, &ed.cap, 1);
+   ed.buf[0] = '\0';
+   historyLoad();
+
+   fflush(stdout);
+   write(STDOUT_FILENO, "\r", 1);
+   for (;;)
+   {
+      editRefresh(&ed, prompt, ed.buf, ed.len, ed.pos);
+
+      int key = readKey();
+      if (key == CTRL_KEY('r'))
+      {
+         key = reverseSearch(&ed);                // Then acts on its last key
+      }
+
+      if (key == -1 || (key == CTRL_KEY('d') && ed.len == 0))
+      {
+         break;                                // End of input
+      }
+      switch (key)
+      {
+         case '\r' : case '\n' :
+            editRefresh(&ed, prompt, ed.buf, ed.len, ed.len);
+            write(STDOUT_FILENO, "\n", 1);
+            editGrow(line, lineSize, ed.len + 1);
+            memcpy(*line, ed.buf, ed.len + 1);
+            result = (ssize_t)ed.len;
+            break;
+
+         case KEY_LEFT : case CTRL_KEY('b') :
+            ed.pos -= ed.pos > 0;
+            break;
+
+         case KEY_RIGHT : case CTRL_KEY('f') :
+            ed.pos += ed.pos < ed.len;
+            break;
+
+         case KEY_HOME : case CTRL_KEY('a') :
+            ed.pos = 0;
+            break;
+
+         case KEY_END : case CTRL_KEY('e') :
+            ed.pos = ed.len;
+            break;
+
+         case 127 : case CTRL_KEY('h') :
+            if (ed.pos > 0)
+            {
+               ed.pos--;
+               editReplace(&ed, 1, "", 0);
+            }
+            break;
+
+         case KEY_DEL : case CTRL_KEY('d') :
+            if (ed.pos < ed.len)
+            {
+               editReplace(&ed, 1, "", 0);
+            }
+            break;
+
+         case CTRL_KEY('u') :
+         {
+            size_t cut = ed.pos;
+            ed.pos = 0;
+            editReplace(&ed, cut, "", 0);
+            break;
+         }
+
+         case CTRL_KEY('k') :
+            editReplace(&ed, ed.len - ed.pos, "", 0);
+            break;
+
+         case CTRL_KEY('w') :
+         {
+            size_t end = ed.pos;
+            while (ed.pos > 0 && ed.buf[ed.pos - 1] == ' ')
+            {
+               ed.pos--;
+            }
+            while (ed.pos > 0 && ed.buf[ed.pos - 1] != ' ')
+            {
+               ed.pos--;
+            }
+            editReplace(&ed, end - ed.pos, "", 0);
+            break;
+         }
+
+         case KEY_UP : case CTRL_KEY('p') :
+         case KEY_DOWN : case CTRL_KEY('n') :
+         {
+            int step = key == KEY_UP || key == CTRL_KEY('p') ? -1 : 1;
+            if (browse + step < histFirst || browse + step > histNext)
+            {
+               break;
+            }
+            if (browse == histNext)                // Leaving the new line
+            {
+               free(pending);
+               pending = strdup(ed.buf);
+            }
+            browse += step;
+            if (browse == histNext)
+            {
+               editSetText(&ed, pending != NULL ? pending : "",
+                           pending != NULL ? strlen(pending) : 0);
+            }
+            else
+            {
+               const HistEntry *entry = &histRing[browse % HIST_MAX];
+               editSetText(&ed, entry->text, entry->len);
+            }
+            break;
+         }
+
+         case '\t' :
+            editComplete(&ed, lastKey == '\t');
+            break;
+
+         case CTRL_KEY('c') :                         // Start over
+            editRefresh(&ed, prompt, ed.buf, ed.len, ed.len);
+            write(STDOUT_FILENO, "^C\n", 3);
+            editForget(&ed);
+            ed.len = ed.pos = 0;
+            ed.buf[0] = '\0';
+            browse = histNext;
+            break;
+
+         case CTRL_KEY('l') :
+            write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+            editForget(&ed);
+            break;
+
+         case KEY_JOBS :                   // Reported below, then redrawn
+            editRefresh(&ed, prompt, ed.buf, ed.len, ed.len);
+            write(STDOUT_FILENO, "\n", 1);
+            notifyJobs();
+            fflush(stdout);
+            editForget(&ed);
+            break;
+
+         default :
+            if (key >= ' ' && key < 256 && key != 127)
+            {
+               char c = (char)key;
+               editReplace(&ed, 0, &c, 1);
+            }
+            break;
+      }
+      lastKey = key;
+      if (result != -1)
+      {
+         break;
+      }
+   }
+
+   tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+   free(ed.buf);
+   free(ed.shown);
+   free(pending);
+   return result;
+}
+
+
+/** ------------------------------- builtinExit -------------------------------
+ * exit [N]       leaves the shell with exit code N (default: the last one)
+ */
+static int builtinExit(char **args)
+{
+   exitRequested = 1;
+   return args[1] != NULL ? atoi(args[1]) & 0xff : lastStatus;
+}
+
+
+/** -------------------------------- builtinCd --------------------------------
+ * cd [DIR]       changes the shell's directory to DIR (default: $HOME)
+ * cd -           goes back to the previous directory and prints it
+ * Keeps PWD and OLDPWD up to date for the commands the shell starts
+ */
+static int builtinCd(char **args)
+{
+   const char *dir = args[1] != NULL ? args[1] : getVar("HOME");
+
+   if (args[1] != NULL && strcmp(args[1], "-") == 0)
+   {
+      dir = getVar("OLDPWD");
+   }
+   if (dir == NULL)
+   {
+      fprintf(stderr, "cd: %s not set\n", args[1] != NULL ? "OLDPWD"
+                                                          : "HOME");
+      return 1;
+   }
+
+   char *oldDir = getcwd(NULL, 0);
+   if (chdir(dir) == -1)
+   {
+      fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+      free(oldDir);
+      return 1;
+   }
+
+   char *newDir = getcwd(NULL, 0);
+   if (oldDir != NULL)
+   {
+      setVar("OLDPWD", 6, oldDir);
+      exportVar("OLDPWD", 6);
+   }
+   if (newDir != NULL)
+   {
+      setVar("PWD", 3, newDir);
+      exportVar("PWD", 3);
+      if (args[1] != NULL && strcmp(args[1], "-") == 0)
+      {
+         printf("%s\n", newDir);
+      }
+   }
+   free(oldDir);
+   free(newDir);
+   return 0;
+}
+
+
+/** ------------------------------- builtinPwd --------------------------------
+ * pwd            prints the shell's directory
+ */
+static int builtinPwd(char **args)
+{
+   char *dir = getcwd(NULL, 0);
+
+   (void)args;
+   if (dir == NULL)
+   {
+      perror("pwd");
+      return 1;
+   }
+   printf("%s\n", dir);
+   free(dir);
+   return 0;
+}
+
+
+/** ------------------------------- builtinEcho -------------------------------
+ * echo [-n] ARGS...   prints ARGS separated by spaces, -n leaves off the
+ *                     newline
+ */
+static int builtinEcho(char **args)
+{
+   int newline = 1;
+   int a = 1;
+
+   while (args[a] != NULL && strcmp(args[a], "-n") == 0)
+   {
+      newline = 0;
+      a++;
+   }
+   for (int first = a; args[a] != NULL; a++)
+   {
+      if (a > first)
+      {
+         putchar(' ');
+      }
+      fputs(args[a], stdout);
+   }
+   if (newline)
+   {
+      putchar('\n');
+   }
+   return 0;
+}
+
+
+/* true (also :) and false */
+static int builtinTrue(char **args)
+{
+   (void)args;
+   return 0;
+}
+
+static int builtinFalse(char **args)
+{
+   (void)args;
+   return 1;
+}
+
+
+/** ------------------------------ testInteger --------------------------------
+ * Reads an integer operand of test
+ * Returns 0, or -1 (after printing why) if text isn't an integer
+ */
+static int testInteger(const char *text, long long *value)
+{
+   char *end;
+
+   errno = 0;
+   *value = strtoll(text, &end, 10);
+   if (end == text || *end != '\0' || errno != 0)
+   {
+      fprintf(stderr, "test: %s: integer expression expected\n", text);
+      return -1;
+   }
+   return 0;
+}
+
+
+/** ------------------------------- testUnary ---------------------------------
+ * Evaluates test OP ARG for the file and string operators (-e -f -d -r -w
+ *   -x -s -L -h -p -S -b -c -z -n)
+ * Returns 1 if true, 0 if false or -1 if OP isn't a unary operator
+ */
+static int testUnary(const char *op, const char *arg)
+{
+   struct stat info;
+
+   if (op[0] != '-' || op[1] == '\0' || op[2] != '\0')
+   {
+      return -1;
+   }
+
+   switch (op[1])
+   {
+      case 'z' : return arg[0] == '\0';
+      case 'n' : return arg[0] != '\0';
+      case 'r' : return access(arg, R_OK) == 0;
+      case 'w' : return access(arg, W_OK) == 0;
+      case 'x' : return access(arg, X_OK) == 0;
+      case 'L' :
+      case 'h' : return lstat(arg, &info) == 0 && S_ISLNK(info.st_mode);
+   }
+
+   if (strchr("efdspSbc", op[1]) == NULL)
+   {
+      return -1;
+   }
+   if (stat(arg, &info) == -1)
+   {
+      return 0;
+   }
+   switch (op[1])
+   {
+      case 'f' : return S_ISREG(info.st_mode);
+      case 'd' : return S_ISDIR(info.st_mode);
+      case 's' : return info.st_size > 0;
+      case 'p' : return S_ISFIFO(info.st_mode);
+      case 'S' : return S_ISSOCK(info.st_mode);
+      case 'b' : return S_ISBLK(info.st_mode);
+      case 'c' : return S_ISCHR(info.st_mode);
+   }
+   return 1;                                   // -e
+}
+
+
+/** ------------------------------- testBinary --------------------------------
+ * Evaluates test LEFT OP RIGHT for = != and the integer comparisons (-eq
+ *   -ne -lt -le -gt -ge)
+ * Returns 1 if true, 0 if false, -1 if OP isn't a binary operator or
+ *   -2 (after printing why) if an integer operand is bad
+ */
+static int testBinary(const char *left, const char *op, const char *right)
+{
+   static const char *intOps[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+   long long x, y;
+
+   if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+   {
+      return strcmp(left, right) == 0;
+   }
+   if (strcmp(op, "!=") == 0)
+   {
+      return strcmp(left, right) != 0;
+   }
+
+   for (int o = 0; o < 6; o++)
+   {
+      if (strcmp(op, intOps[o]) != 0)
+      {
+         continue;
+      }
+      if (testInteger(left, &x) == -1 || testInteger(right, &y) == -1)
+      {
+         return -2;
+      }
+      switch (o)
+      {
+         case 0 : return x == y;
+         case 1 : return x != y;
+         case 2 : return x < y;
+         case 3 : return x <= y;
+         case 4 : return x > y;
+         default : return x >= y;
+      }
+   }
+   return -1;
+}
+
+
+/** -------------------------------- testExpr ---------------------------------
+ * Evaluates a test expression of argc words by how many there are, the way
+ *   POSIX test does: 1 word is true if non-empty, 2 is ! WORD or a unary
+ *   operator, 3 is a binary operator, ! and 2 words or ( WORD ), and 4 is
+ *   ! and 3 words
+ * Returns the exit code, 0 true, 1 false or 2 for a bad expression
+ */
+static int testExpr(char **argv, int argc)
+{
+   int result = -1;
+
+   switch (argc)
+   {
+      case 0 :
+         return 1;
+
+      case 1 :
+         return argv[0][0] == '\0';
+
+      case 2 :
+         if (strcmp(argv[0], "!") == 0)
+         {
+            return testExpr(argv + 1, 1) == 0;
+         }
+         result = testUnary(argv[0], argv[1]);
+         break;
+
+      case 3 :
+         result = testBinary(argv[0], argv[1], argv[2]);
+         if (result == -1 && strcmp(argv[0], "!") == 0)
+         {
+            int inner = testExpr(argv + 1, 2);
+            return inner == 2 ? 2 : !inner;
+         }
+         if (result == -1 && strcmp(argv[0], "(") == 0
+             && strcmp(argv[2], ")") == 0)
+         {
+            return testExpr(argv + 1, 1);
+         }
+         break;
+
+      case 4 :
+         if (strcmp(argv[0], "!") == 0)
+         {
+            int inner = testExpr(argv + 1, 3);
+            return inner == 2 ? 2 : !inner;
+         }
+         break;
+   }
+
+   if (result == -1)
+   {
+      fprintf(stderr, "test: syntax error\n");
+   }
+   return result < 0 ? 2 : !result;
+}
+
+
+/** ------------------------------- builtinTest -------------------------------
+ * test EXPR, [ EXPR ]   exits 0 if EXPR is true, 1 if it's false
+ */
+static int builtinTest(char **args)
+{
+   int argc = 1;
+
+   while (args[argc] != NULL)
+   {
+      argc++;
+   }
+   if (strcmp(args[0], "[") == 0)
+   {
+      if (strcmp(args[argc - 1], "]") != 0 || argc == 1)
+      {
+         fprintf(stderr, "[: missing ]\n");
+         return 2;
+      }
+      argc--;
+   }
+   return testExpr(args + 1, argc - 1);
+}
+
+
+/** ------------------------------ builtinExport ------------------------------
+ * export                   lists the exported variables
+ * export NAME[=VALUE]...   exports each NAME (setting it first), so the
+ *                          shell's commands get it in their environment
+ */
+static int builtinExport(char **args)
+{
+   int status = 0;
+
+   if (args[1] == NULL)
+   {
+      for (char **env = shellEnv(); *env != NULL; env++)
+      {
+         printf("export %s\n", *env);
+      }
+      return 0;
+   }
+
+   for (int a = 1; args[a] != NULL; a++)
+   {
+      char *equals = strchr(args[a], '=');
+      size_t nameLen = equals != NULL ? (size_t)(equals - args[a])
+                                      : strlen(args[a]);
+
+      if (!validName(args[a], nameLen))
+      {
+         fprintf(stderr, "export: %s: not a valid name\n", args[a]);
+         status = 1;
+      }
+      else
+      {
+         if (equals != NULL)
+         {
+            setVar(args[a], nameLen, equals + 1);
+         }
+         exportVar(args[a], nameLen);
+      }
+   }
+   return status;
+}
+
+
+/** ------------------------------ builtinUnset -------------------------------
+ * unset NAME...  removes each variable NAME (and from the environment)
+ */
+static int builtinUnset(char **args)
+{
+   int status = 0;
+
+   for (int a = 1; args[a] != NULL; a++)
+   {
+      if (!validName(args[a], strlen(args[a])))
+      {
+         fprintf(stderr, "unset: %s: not a valid name\n", args[a]);
+         status = 1;
+         continue;
+      }
+      unsetVar(args[a]);
+   }
+   return status;
+}
+
+
+/** ------------------------------ printEscape --------------------------------
+ * Prints the backslash escape starting at c (\n \t \\ \0NNN etc.)
+ * Returns a pointer to its last character
+ */
+static const char *printEscape(const char *c)
+{
+   static const char escapes[] = "a\ab\bf\fn\nr\rt\tv\v\\\\";
+
+   if (c[1] == '\0')
+   {
+      putchar('\\');
+      return c;
+   }
+   if (c[1] == '0')                            // Octal, up to 3 digits
+   {
+      int value = 0;
+      int d = 2;
+      for (; d < 5 && c[d] >= '0' && c[d] <= '7'; d++)
+      {
+         value = value * 8 + (c[d] - '0');
+      }
+      putchar(value);
+      return c + d - 1;
+   }
+   for (int e = 0; escapes[e] != '\0'; e += 2)
+   {
+      if (escapes[e] == c[1])
+      {
+         putchar(escapes[e + 1]);
+         return c + 1;
+      }
+   }
+   putchar('\\');                              // Not an escape, kept as is
+   putchar(c[1]);
+   return c + 1;
+}
+
+
+/** ------------------------------ printNumber --------------------------------
+ * Reads a numeric printf argument, 'c gives the code of character c
+ * Returns 0, or -1 (after printing why) if text isn't a number
+ */
+static int printNumber(const char *text, long long *value)
+{
+   char *end;
+
+   if (text[0] == '\'' || text[0] == '"')
+   {
+      *value = (unsigned char)text[1];
+      return 0;
+   }
+   errno = 0;
+   *value = strtoll(text, &end, 0);
+   if (end == text || *end != '\0' || errno != 0)
+   {
+      fprintf(stderr, "printf: %s: invalid number\n", text);
+      return -1;
+   }
+   return 0;
+}
+
+
+/** ------------------------------ builtinPrintf ------------------------------
+ * printf FORMAT ARGS...   prints ARGS under the control of FORMAT
+ * Supports the escapes of printEscape() and %s %b %c %d %i %u %o %x %X
+ *   %e %f %g %% with flags, width and precision, the format is reused
+ *   until every argument has been printed
+ */
+static int builtinPrintf(char **args)
+{
+   int status = 0;
+
+   if (args[1] == NULL)
+   {
+      fprintf(stderr, "printf: usage: printf FORMAT [ARGS...]\n");
+      return 2;
+   }
+
+   char **arg = &args[2];
+   do
+   {
+      char **passStart = arg;
+
+      for (const char *f = args[1]; *f != '\0'; f++)
+      {
+         if (*f == '\\')
+         {
+            f = printEscape(f);
+            continue;
+         }
+         if (*f != '%')
+         {
+            putchar(*f);
+            continue;
+         }
+         if (f[1] == '%')
+         {
+            putchar('%');
+            f++;
+            continue;
+         }
+
+         // Copy the flags, width and precision into a printf() spec
+         char spec[32] = "%";
+         size_t len = 1;
+         for (f++; *f != '\0' && strchr("-+ #0123456789.", *f) != NULL
+                   && len < sizeof(spec) - 4; f++)
+         {
+            spec[len++] = *f;
+         }
+         if (*f == '\0')
+         {
+            fprintf(stderr, "printf: missing conversion\n");
+            return 1;
+         }
+
+         const char *value = *arg != NULL ? *arg++ : NULL;
+         long long number = 0;
+         switch (*f)
+         {
+            case 's' :
+               strcpy(spec + len, "s");
+               printf(spec, value != NULL ? value : "");
+               break;
+
+            case 'b' :                         // String with escapes
+               for (const char *c = value; c != NULL && *c != '\0'; c++)
+               {
+                  if (*c == '\\')
+                  {
+                     c = printEscape(c);
+                  }
+                  else
+                  {
+                     putchar(*c);
+                  }
+               }
+               break;
+
+            case 'c' :
+               strcpy(spec + len, "c");
+               printf(spec, value != NULL ? value[0] : '\0');
+               break;
+
+            case 'd' : case 'i' : case 'u' : case 'o' : case 'x' : case 'X' :
+               if (value != NULL && printNumber(value, &number) == -1)
+               {
+                  status = 1;
+               }
+               spec[len++] = 'l';
+               spec[len++] = 'l';
+               spec[len++] = *f;
+               spec[len] = '\0';
+               printf(spec, number);
+               break;
+
+            case 'e' : case 'E' : case 'f' : case 'g' : case 'G' :
+               spec[len++] = *f;
+               spec[len] = '\0';
+               printf(spec, value != NULL ? strtod(value, NULL) : 0.0);
+               break;
+
+            default :
+               fprintf(stderr, "printf: %%%c: invalid directive\n", *f);
+               return 1;
+         }
+      }
+
+      if (arg == passStart)          // The format takes no arguments
+      {
+         break;
+      }
+   } while (*arg != NULL);
+
+   return status;
+}
+
+
+/* Every builtin, sorted by name for findBuiltin() */
+static const Builtin builtins[] =
+{
+   { ":", builtinTrue },            { "[", builtinTest },
+   { "bg", builtinBg },             { "cd", builtinCd },
+   { "coproc", builtinCoproc },     { "echo", builtinEcho },
+   { "exit", builtinExit },         { "export", builtinExport },
+   { "false", builtinFalse },       { "fg", builtinFg },
+   { "hash", builtinHash },         { "history", builtinHistory },
+   { "jobs", builtinJobs },         { "kill", builtinKill },
+   { "parallel", builtinParallel }, { "printf", builtinPrintf },
+   { "pwd", builtinPwd },           { "set", builtinSet },
+   { "test", builtinTest },         { "timeout", builtinTimeout },
+   { "true", builtinTrue },         { "ulimit", builtinUlimit },
+   { "unset", builtinUnset },       { "wait", builtinWait },
+};
+
+
+/** ------------------------------ builtinName --------------------------------
+ * Name of builtin b in the table's sorted order, NULL past the last one
+ */
+static const char *builtinName(int b)
+{
+   return b >= 0 && b < (int)(sizeof(builtins) / sizeof(builtins[0]))
+          ? builtins[b].name : NULL;
+}
+
+
+/** ------------------------------ findBuiltin --------------------------------
+ * Looks name up in the builtin table with a binary search, a handful of
+ *   string compares at most
+ * Returns the builtin, or NULL if name isn't one
+ */
+static const Builtin *findBuiltin(const char *name)
+{
+   size_t low = 0;
+   size_t high = sizeof(builtins) / sizeof(builtins[0]);
+
+   while (low < high)
+   {
+      size_t mid = (low + high) / 2;
+      int order = strcmp(name, builtins[mid].name);
+
+      if (order == 0)
+      {
+         return &builtins[mid];
+      }
+      if (order < 0)
+      {
+         high = mid;
+      }
+      else
+      {
+         low = mid + 1;
+      }
+   }
+   return NULL;
+}
+
+
+/** ------------------------------ runBuiltin ---------------------------------
+ * Runs a single builtin command inside the shell, so it can change the
+ *   shell itself (cd, export, exit...) and costs no process
+ * Its redirects are applied to the shell's own descriptors, which are
+ *   saved first and put back once the builtin is done
+ * Returns the builtin's exit code, or 1 if a redirect failed
+ */
+static int runBuiltin(const Builtin *builtin, const Stage *st)
+{
+   int saved[st->numRedirs > 0 ? st->numRedirs : 1];
+   int numApplied = 0;
+   int failed = 0;
+   int status = 1;
+
+   fflush(stdout);                            // Old output to the old place
+   for (; numApplied < st->numRedirs; numApplied++)
+   {
+      const Redirect *redir = &st->redirs[numApplied];
+      int fd = redir->dupFrom;
+
+      if (fd == -1)
+      {
+         fd = open(redir->file, redir->flags, 0666);
+         if (fd == -1)
+         {
+            fprintf(stderr, "%s %s: %s\n", redir->flags == O_RDONLY
+                                           ? "Input file failed"
+                                           : "Output file failed",
+                    redir->file, strerror(errno));
+            failed = 1;
+            break;
+         }
+      }
+
+      // -1 if redir->fd wasn't open, then it's closed again afterwards
+      saved[numApplied] = fcntl(redir->fd, F_DUPFD_CLOEXEC, 10);
+      if (fd != redir->fd && dup2(fd, redir->fd) == -1)
+      {
+         perror("Redirect failed");
+         numApplied++;
+         failed = 1;
+         break;
+      }
+      if (redir->dupFrom == -1 && fd != redir->fd)
+      {
+         close(fd);
+      }
+      if (redir->fd == STDIN_FILENO)
+      {
+         stdinRedirected = 1;
+      }
+   }
+
+   if (!failed)
+   {
+      status = builtin->run(st->argv);
+   }
+
+   fflush(stdout);
+   while (numApplied-- > 0)                   // Undo in reverse order
+   {
+      int fd = st->redirs[numApplied].fd;
+      if (saved[numApplied] == -1)
+      {
+         close(fd);
+      }
+      else
+      {
+         dup2(saved[numApplied], fd);
+         close(saved[numApplied]);
+      }
+   }
+   stdinRedirected = 0;
+   return status;
+}
+
+
+/** ------------------------------- printTimes --------------------------------
+ * Reports a timed command on stderr: real, user and sys time, and the
+ *   largest resident set of any of its processes
+ */
+static void printTimes(double wallUsec, const struct rusage *usage)
+{
+   const struct { const char *name; double usec; } times[] =
+   {
+      { "real", wallUsec },
+      { "user", usage->ru_utime.tv_sec * 1e6 + usage->ru_utime.tv_usec },
+      { "sys", usage->ru_stime.tv_sec * 1e6 + usage->ru_stime.tv_usec },
+   };
+
+   fprintf(stderr, "\n");
+   for (int t = 0; t < 3; t++)
+   {
+      int minutes = (int)(times[t].usec / 60e6);
+      fprintf(stderr, "%s\t%dm%.3fs\n", times[t].name, minutes,
+              (times[t].usec - minutes * 60e6) / 1e6);
+   }
+   fprintf(stderr, "maxrss\t%ld KiB\n", usage->ru_maxrss);
+}
+
+
+/* A pipeline, as runParsed() runs it */
+typedef struct
+{
+   Stage *stages;
+   int numStages;
+   int bgProcess;          // Ended with &
+   int timed;              // Started with time
+   int expand;             // Has $ references or substitutions, redone
+                           //   each time it runs
+   const char *text;       // Command text for the job table
+   const cpu_set_t *cpus;  // From @cpus=, NULL for the set cpus= default
+} Command;
+
+/* Command tree, a line is a list of && || chains of pipelines and of if,
+ *   while, until and for commands, whose parts are lists again */
+enum { NODE_PIPELINE, NODE_LIST, NODE_AND, NODE_OR, NODE_NOT, NODE_IF,
+       NODE_WHILE, NODE_UNTIL, NODE_FOR };
+typedef struct Node
+{
+   int type;
+   Command cmd;            // NODE_PIPELINE
+   struct Node *left;      // LIST, AND, OR: first part, NOT: what it negates,
+                           //   IF, WHILE, UNTIL: the condition
+   struct Node *right;     // LIST, AND, OR: second part, IF: then part,
+                           //   WHILE, UNTIL, FOR: the body
+   struct Node *orElse;    // IF: else part (an elif is an IF), or NULL
+   char *name;             // FOR: the variable
+   char **words;           // FOR: NULL terminated values
+} Node;
+
+/* Where parseLine() is in a line's tokens */
+#define CMD_INCOMPLETE -1  /* The line ends in the middle of a command */
+typedef struct
+{
+   const Token *tokens;
+   int numTokens;
+   int pos;                // Next token
+   Arena *arena;           // Where the tree goes
+   const char *line;       // The line as typed, for job texts and errors
+   int status;             // 0, 2 after a syntax error or CMD_INCOMPLETE
+} Parser;
+
+/* Words that end a part of an if, while, until or for, they can't start
+ *   a command */
+static const char *const reservedWords[] =
+   { "then", "elif", "else", "fi", "do", "done", NULL };
+
+/* Parse cache, the last PARSE_CACHE_SIZE distinct lines and what they
+ *   parsed to, found through a chained hash of the line text and evicted
+ *   least recently used first */
+#define PARSE_CACHE_SIZE 256
+#define PARSE_CACHE_SLOTS 509      /* Prime, about 2 slots per entry */
+typedef struct CacheEntry
+{
+   struct CacheEntry *next;        // Same hash slot
+   struct CacheEntry *newer;       // LRU order
+   struct CacheEntry *older;
+   unsigned long hash;
+   const char *line;
+   const Node *root;
+   Arena arena;                    // Holds the entry itself, line and tree
+} CacheEntry;
+static CacheEntry *cacheSlots[PARSE_CACHE_SLOTS];
+static CacheEntry *cacheNewest = NULL;
+static CacheEntry *cacheOldest = NULL;
+static int cacheCount = 0;
+
+
+/** -------------------------------- hashLine ---------------------------------
+ * FNV-1a hash of a command line for the parse cache
+ */
+static unsigned long hashLine(const char *line)
+{
+   unsigned long h = 2166136261u;
+   for (const char *c = line; *c != '\0'; c++)
+   {
+      h = (h ^ (unsigned char)*c) * 16777619u;
+   }
+   return h;
+}
+
+
+/** ------------------------------ buildStages --------------------------------
+ * Sorts the numTokens tokens of one pipeline into its stages, allocated
+ *   from arena, and fills in cmd's stages and whether it needs expanding
+ * NAME=VALUE words before a stage's command are kept apart as its assigns
+ * Returns 0, or 2 (after printing why) for a bad redirect or no command
+ */
+static int buildStages(Arena *arena, const Token *tokens, int numTokens,
+                       Command *cmd)
+{
+   //  Every | ends a stage's arguments with a NULL, each redirect and its
+   //    target use two tokens, so args never needs more than numTokens + 1
+   //    entries and redirs never more than numTokens (&> makes two)
+   //  A stage's redirects are kept in order, after the ones of the stage
+   //    before it, and so are its assigns, each list ending with a NULL
+   char **args = arenaAlloc(arena, (numTokens + 1) * sizeof(char *));
+   char **assigns = arenaAlloc(arena, (2 * numTokens + 1) * sizeof(char *));
+   Stage *stages = arenaAlloc(arena, (numTokens + 1) * sizeof(Stage));
+   Redirect *redirs = arenaAlloc(arena, numTokens * sizeof(Redirect));
+   int numArgs = 0;
+   int numAssigns = 0;
+   int numStages = 1;
+   int numRedirs = 0;
+   stages[0] = (Stage){ args, redirs, 0, NULL, NULL };
+   cmd->expand = 0;
+   for (int i = 0; i < numTokens; i++)
+   {
+      const Token *tok = &tokens[i];
+      Stage *stage = &stages[numStages - 1];
+
+      if (tok->type == TOK_WORD)
+      {
+         const char *equals = strchr(tok->text, '=');
+         cmd->expand |= strpbrk(tok->text, EXPAND_MARKS) != NULL;
+         if (stage->argv == &args[numArgs] && equals != NULL
+             && validName(tok->text, equals - tok->text))
+         {
+            if (stage->assigns == NULL)  // Before the command
+            {
+               stage->assigns = &assigns[numAssigns];
+            }
+            assigns[numAssigns++] = tok->text;
+            continue;
+         }
+         args[numArgs++] = tok->text;
+         continue;
+      }
+      if (tok->type == TOK_PIPE)          // End the previous stage
+      {
+         args[numArgs++] = NULL;
+         if (stage->assigns != NULL)
+         {
+            assigns[numAssigns++] = NULL;
+         }
+         stages[numStages++] = (Stage){ &args[numArgs], &redirs[numRedirs],
+                                        0, NULL, NULL };
+         continue;
+      }
+      if (tok->type == TOK_NEWLINE)       // After a |, the pipe goes on
+      {
+         continue;
+      }
+
+      // Every redirect needs a file name (or descriptor) after it
+      if (i + 1 == numTokens || tokens[i + 1].type != TOK_WORD)
+      {
+         fprintf(stderr, "%s file failed: missing file name\n",
+                 tok->type == TOK_IN ? "Input" : "Output");
+         return 2;
+      }
+      const char *target = tokens[++i].text;
+      Redirect *redir = &redirs[numRedirs++];
+      cmd->expand |= strpbrk(target, EXPAND_MARKS) != NULL;
+      stage->numRedirs++;
+      *redir = (Redirect){ tok->fd, -1, target, 0 };
+
+      switch (tok->type)
+      {
+         case TOK_IN :
+            redir->flags = O_RDONLY;
+            break;
+
+         case TOK_OUT :                   // Clears the file first
+         case TOK_BOTH :
+            redir->flags = O_WRONLY | O_CREAT | O_TRUNC;
+            break;
+
+         case TOK_APPEND :
+         case TOK_BOTH_APPEND :
+            redir->flags = O_WRONLY | O_CREAT | O_APPEND;
+            break;
+
+         case TOK_DUP :                   // 2>&1 and the like
+            if (target[0] == '\0'
+                || strspn(target, "0123456789") != strlen(target))
+            {
+               fprintf(stderr, "Syntax error: bad descriptor %s\n", target);
+               return 2;
+            }
+            redir->dupFrom = atoi(target);
+            break;
+      }
+
+      if (tok->type == TOK_BOTH || tok->type == TOK_BOTH_APPEND)
+      {
+         redir->fd = STDOUT_FILENO;       // &> is >file 2>&1
+         redirs[numRedirs++] = (Redirect){ STDERR_FILENO, STDOUT_FILENO,
+                                           NULL, 0 };
+         stage->numRedirs++;
+      }
+   }
+   args[numArgs] = NULL;
+   assigns[numAssigns] = NULL;
+
+   if (args[0] == NULL && stages[0].assigns == NULL)
+   {
+      fprintf(stderr, "Missing command\n");
+      return 2;
+   }
+
+   cmd->stages = stages;
+   cmd->numStages = numStages;
+   return 0;
+}
+
+
+/** ------------------------------- atKeyword ---------------------------------
+ * Whether the parser's next token is the unquoted word keyword
+ */
+static int atKeyword(const Parser *p, const char *keyword)
+{
+   return p->pos < p->numTokens && p->tokens[p->pos].type == TOK_WORD
+          && p->tokens[p->pos].plain
+          && strcmp(p->tokens[p->pos].text, keyword) == 0;
+}
+
+
+/** ------------------------------ atAnyKeyword -------------------------------
+ * Whether the parser's next token is one of the NULL terminated keywords
+ */
+static int atAnyKeyword(const Parser *p, const char *const *keywords)
+{
+   for (int k = 0; keywords[k] != NULL; k++)
+   {
+      if (atKeyword(p, keywords[k]))
+      {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+
+/** ------------------------------ syntaxError --------------------------------
+ * Fails the parse at the next token, or marks the command as going on over
+ *   the next line if the tokens ran out first
+ */
+static void syntaxError(Parser *p)
+{
+   if (p->status != 0)
+   {
+      return;
+   }
+   if (p->pos == p->numTokens)
+   {
+      p->status = CMD_INCOMPLETE;
+      return;
+   }
+
+   const Token *tok = &p->tokens[p->pos];
+   if (tok->type == TOK_NEWLINE)
+   {
+      fprintf(stderr, "Syntax error: unexpected newline\n");
+   }
+   else
+   {
+      fprintf(stderr, "Syntax error: unexpected %.*s\n",
+              tok->end - tok->start, p->line + tok->start);
+   }
+   p->status = 2;
+}
+
+
+/** ----------------------------- expectKeyword -------------------------------
+ * Moves past keyword if it's next, otherwise fails the parse
+ * Returns whether the parse can go on
+ */
+static int expectKeyword(Parser *p, const char *keyword)
+{
+   if (p->status == 0 && atKeyword(p, keyword))
+   {
+      p->pos++;
+      return 1;
+   }
+   syntaxError(p);
+   return 0;
+}
+
+
+/** ---------------------------- skipSeparators -------------------------------
+ * Moves past any ; and newlines
+ */
+static void skipSeparators(Parser *p)
+{
+   while (p->pos < p->numTokens && (p->tokens[p->pos].type == TOK_SEMI
+                                    || p->tokens[p->pos].type == TOK_NEWLINE))
+   {
+      p->pos++;
+   }
+}
+
+
+/** -------------------------------- newNode ----------------------------------
+ * Returns an empty tree node of type from the parser's arena
+ */
+static Node *newNode(Parser *p, int type)
+{
+   Node *node = arenaAlloc(p->arena, sizeof(Node));
+   memset(node, 0, sizeof(Node));
+   node->type = type;
+   return node;
+}
+
+
+static Node *parseList(Parser *p, const char *const *ends);
+static Node *parseBody(Parser *p, const char *const *ends);
+
+
+/** ------------------------------- parseIf -----------------------------------
+ * if LIST then LIST [elif LIST then LIST]... [else LIST] fi
+ *   (starting at the if or elif)
+ */
+static Node *parseIf(Parser *p)
+{
+   static const char *const condEnd[] = { "then", NULL };
+   static const char *const thenEnd[] = { "elif", "else", "fi", NULL };
+   static const char *const elseEnd[] = { "fi", NULL };
+   Node *node = newNode(p, NODE_IF);
+
+   p->pos++;
+   node->left = parseBody(p, condEnd);
+   if (!expectKeyword(p, "then"))
+   {
+      return NULL;
+   }
+   node->right = parseBody(p, thenEnd);
+   if (atKeyword(p, "elif"))               // Its own if, that ends at the fi
+   {
+      node->orElse = parseIf(p);
+      return p->status == 0 ? node : NULL;
+   }
+   if (atKeyword(p, "else"))
+   {
+      p->pos++;
+      node->orElse = parseBody(p, elseEnd);
+   }
+   return expectKeyword(p, "fi") ? node : NULL;
+}
+
+
+/** ------------------------------ parseWhile ---------------------------------
+ * while LIST do LIST done, or the same with until
+ */
+static Node *parseWhile(Parser *p)
+{
+   static const char *const condEnd[] = { "do", NULL };
+   static const char *const bodyEnd[] = { "done", NULL };
+   Node *node = newNode(p, atKeyword(p, "while") ? NODE_WHILE : NODE_UNTIL);
+
+   p->pos++;
+   node->left = parseBody(p, condEnd);
+   if (!expectKeyword(p, "do"))
+   {
+      return NULL;
+   }
+   node->right = parseBody(p, bodyEnd);
+   return expectKeyword(p, "done") ? node : NULL;
+}
+
+
+/** ------------------------------- parseFor ----------------------------------
+ * for NAME [in WORD...] do LIST done, with a ; or newline before the do
+ */
+static Node *parseFor(Parser *p)
+{
+   static const char *const bodyEnd[] = { "done", NULL };
+   Node *node = newNode(p, NODE_FOR);
+
+   p->pos++;
+   const Token *name = &p->tokens[p->pos];
+   if (p->pos == p->numTokens || name->type != TOK_WORD
+       || !validName(name->text, strlen(name->text)))
+   {
+      syntaxError(p);
+      return NULL;
+   }
+   node->name = name->text;
+   p->pos++;
+
+   int first = p->pos;
+   if (atKeyword(p, "in"))
+   {
+      first = ++p->pos;
+      while (p->pos < p->numTokens && p->tokens[p->pos].type == TOK_WORD)
+      {
+         p->pos++;
+      }
+   }
+   node->words = arenaAlloc(p->arena, (p->pos - first + 1) * sizeof(char *));
+   for (int w = first; w < p->pos; w++)
+   {
+      node->words[w - first] = p->tokens[w].text;
+   }
+   node->words[p->pos - first] = NULL;
+
+   skipSeparators(p);
+   if (!expectKeyword(p, "do"))
+   {
+      return NULL;
+   }
+   node->right = parseBody(p, bodyEnd);
+   return expectKeyword(p, "done") ? node : NULL;
+}
+
+
+/** ----------------------------- parsePipeline -------------------------------
+ * A pipeline, which can be negated with !, or a compound command
+ * A pipeline takes every token up to the next ; newline & && or ||, and a
+ *   leading time times all of it
+ */
+static Node *parsePipeline(Parser *p)
+{
+   if (atKeyword(p, "!"))
+   {
+      Node *node = newNode(p, NODE_NOT);
+      p->pos++;
+      node->left = parsePipeline(p);
+      return p->status == 0 ? node : NULL;
+   }
+   if (atKeyword(p, "if"))
+   {
+      return parseIf(p);
+   }
+   if (atKeyword(p, "while") || atKeyword(p, "until"))
+   {
+      return parseWhile(p);
+   }
+   if (atKeyword(p, "for"))
+   {
+      return parseFor(p);
+   }
+   if (p->pos == p->numTokens || atAnyKeyword(p, reservedWords))
+   {
+      syntaxError(p);
+      return NULL;
+   }
+
+   // A time with nothing after it is just a command called time
+   int first = p->pos;
+   int timed = 0;
+   if (atKeyword(p, "time") && p->pos + 1 < p->numTokens
+       && p->tokens[p->pos + 1].type != TOK_SEMI
+       && p->tokens[p->pos + 1].type != TOK_NEWLINE)
+   {
+      timed = 1;
+      p->pos++;
+   }
+
+   // @cpus=LIST pins the pipeline to those CPUs
+   const cpu_set_t *cpus = NULL;
+   if (p->pos < p->numTokens && p->tokens[p->pos].type == TOK_WORD
+       && p->tokens[p->pos].plain
+       && strncmp(p->tokens[p->pos].text, "@cpus=", 6) == 0)
+   {
+      cpu_set_t *set = arenaAlloc(p->arena, sizeof(cpu_set_t));
+      if (parseCpus(p->tokens[p->pos].text + 6, set) == -1)
+      {
+         fprintf(stderr, "Bad CPU list %s\n", p->tokens[p->pos].text + 6);
+         p->status = 2;
+         return NULL;
+      }
+      cpus = set;
+      p->pos++;
+   }
+
+   int begin = p->pos;
+   int afterPipe = 0;                          // A newline can follow a |
+   for (; p->pos < p->numTokens; p->pos++)
+   {
+      int type = p->tokens[p->pos].type;
+      if (type == TOK_SEMI || type == TOK_BG || type == TOK_AND
+          || type == TOK_OR || (type == TOK_NEWLINE && !afterPipe))
+      {
+         break;
+      }
+      afterPipe = type == TOK_PIPE || (afterPipe && type == TOK_NEWLINE);
+   }
+   if (p->pos == begin || afterPipe)
+   {
+      syntaxError(p);
+      return NULL;
+   }
+
+   Node *node = newNode(p, NODE_PIPELINE);
+   if (buildStages(p->arena, &p->tokens[begin], p->pos - begin,
+                   &node->cmd) != 0)
+   {
+      p->status = 2;
+      return NULL;
+   }
+   int start = p->tokens[first].start;
+   node->cmd.timed = timed;
+   node->cmd.cpus = cpus;
+   node->cmd.text = arenaStrndup(p->arena, p->line + start,
+                                 p->tokens[p->pos - 1].end - start);
+   return node;
+}
+
+
+/** ------------------------------- parseAndOr --------------------------------
+ * Pipelines joined by && and ||, which group from the left
+ */
+static Node *parseAndOr(Parser *p)
+{
+   Node *node = parsePipeline(p);
+
+   while (p->status == 0 && p->pos < p->numTokens
+          && (p->tokens[p->pos].type == TOK_AND
+              || p->tokens[p->pos].type == TOK_OR))
+   {
+      Node *pair = newNode(p, p->tokens[p->pos].type == TOK_AND
+                              ? NODE_AND : NODE_OR);
+      p->pos++;
+      while (p->pos < p->numTokens
+             && p->tokens[p->pos].type == TOK_NEWLINE)
+      {
+         p->pos++;                             // a &&, then b on a new line
+      }
+      pair->left = node;
+      pair->right = parsePipeline(p);
+      node = pair;
+   }
+   return p->status == 0 ? node : NULL;
+}
+
+
+/** ------------------------------- parseList ---------------------------------
+ * And-or lists separated by ; & or newlines, up to the end of the line or
+ *   (when ends isn't NULL) one of the keywords in ends, which must come
+ * A & only backgrounds a pipeline
+ * Returns the list as a chain of NODE_LISTs, NULL if it's empty or the
+ *   parse failed
+ */
+static Node *parseList(Parser *p, const char *const *ends)
+{
+   Node *list = NULL;
+   Node **tail = &list;           // Where the last part of the list is kept
+
+   for (;;)
+   {
+      skipSeparators(p);
+      if (p->pos == p->numTokens)
+      {
+         if (ends != NULL)
+         {
+            syntaxError(p);        // The line ended before a fi or done
+         }
+         break;
+      }
+      if (ends != NULL && atAnyKeyword(p, ends))
+      {
+         break;
+      }
+
+      Node *node = parseAndOr(p);
+      if (node == NULL)
+      {
+         return NULL;
+      }
+      if (p->pos < p->numTokens && p->tokens[p->pos].type == TOK_BG)
+      {
+         if (node->type != NODE_PIPELINE)
+         {
+            fprintf(stderr, "Syntax error: only a pipeline can run in the "
+                            "background\n");
+            p->status = 2;
+            return NULL;
+         }
+         node->cmd.bgProcess = 1;
+         p->pos++;
+      }
+
+      if (*tail == NULL)
+      {
+         *tail = node;
+      }
+      else
+      {
+         Node *pair = newNode(p, NODE_LIST);
+         pair->left = *tail;
+         pair->right = node;
+         *tail = pair;
+         tail = &pair->right;
+      }
+
+      // Something has to separate the next command from this one
+      int type = p->pos < p->numTokens ? p->tokens[p->pos].type : TOK_SEMI;
+      if (type != TOK_SEMI && type != TOK_NEWLINE
+          && p->tokens[p->pos - 1].type != TOK_BG
+          && (ends == NULL || !atAnyKeyword(p, ends)))
+      {
+         syntaxError(p);
+         return NULL;
+      }
+   }
+   return p->status == 0 ? list : NULL;
+}
+
+
+/** ------------------------------- parseBody ---------------------------------
+ * A part of an if, while, until or for, a list that can't be empty
+ */
+static Node *parseBody(Parser *p, const char *const *ends)
+{
+   Node *body = parseList(p, ends);
+
+   if (body == NULL)
+   {
+      syntaxError(p);                       // At the then, do or fi
+   }
+   return body;
+}
+
+
+/** ----------------------------- flattenLines --------------------------------
+ * Puts a command typed over several lines on one line for the history,
+ *   each newline outside quotes becomes "; ", or a space after | && || ;
+ *   or &, and a backslash and newline are dropped
+ * A # comment is dropped up to its newline, it would hide the rest of the
+ *   line; like in lexLine() it only starts at the start of a word
+ */
+static char *flattenLines(Arena *arena, const char *text)
+{
+   char *flat = arenaAlloc(arena, 2 * strlen(text) + 1);
+   char *out = flat;
+   char quote = '\0';
+   int wordStart = 1;         // After a blank or operator, or at the start
+
+   for (const char *c = text; *c != '\0'; c++)
+   {
+      if (*c == '\\' && quote != '\'' && c[1] != '\0')
+      {
+         if (c[1] != '\n')
+         {
+            *out++ = c[0];
+            *out++ = c[1];
+            wordStart = 0;
+         }
+         c++;
+         continue;
+      }
+      if (*c == '#' && quote == '\0' && wordStart)
+      {
+         while (c[1] != '\0' && c[1] != '\n')
+         {
+            c++;
+         }
+         continue;
+      }
+      wordStart = quote == '\0' && strchr(" \t\n|;<>&", *c) != NULL;
+      if (quote != '\0' ? *c == quote : (*c == '\'' || *c == '"'))
+      {
+         quote = quote != '\0' ? '\0' : *c;
+      }
+      else if (*c == '\n' && quote == '\0')
+      {
+         while (out > flat && (out[-1] == ' ' || out[-1] == '\t'))
+         {
+            out--;
+         }
+         if (out > flat && !strchr("|&;", out[-1]))
+         {
+            *out++ = ';';
+         }
+         *out++ = ' ';
+         continue;
+      }
+      *out++ = *c;
+   }
+   *out = '\0';
+   return flat;
+}
+
+
+/* Words of the pipeline being run after expanding them, emptied before the
+ *   next one is expanded */
+static Arena wordArena = { NULL };
+
+/* Stands for the blanks an unquoted value is split at, in expandText() */
+#define FIELD_BREAK '\003'
+
+
+/* Command substitutions of the words being expanded, all started before
+ *   any is read so they run side by side */
+typedef struct
+{
+   const char *at;         // Its SUBST_ mark in the word
+   pid_t pid;
+   int fd;                 // Read end of its pipe, -1 once at EOF
+   double started;         // nowUsec() when it was forked
+   char *output;           // Everything it printed, grown as it's read
+   size_t len;
+   size_t cap;
+} Subst;
+static Subst *substs = NULL;
+static int numSubsts = 0;
+static int substCap = 0;
+static int substStatus = 0;        // Exit code of the last one collected
+
+static int runCommand(Arena *arena, const char *theCommand);
+
+
+/** ------------------------------- markLength --------------------------------
+ * Length of what follows the mark lexLine() left at mark: a variable
+ *   reference, or a substitution's command along with its SUBST_END
+ */
+static size_t markLength(const char *mark)
+{
+   if (*mark == SUBST_PLAIN || *mark == SUBST_QUOTED)
+   {
+      return strchr(mark, SUBST_END) - mark;
+   }
+   return varRefLength(mark + 1);
+}
+
+
+/** ------------------------------ clearSubsts --------------------------------
+ * Forgets the substitutions of the last words expanded
+ */
+static void clearSubsts(void)
+{
+   for (int s = 0; s < numSubsts; s++)
+   {
+      free(substs[s].output);
+   }
+   numSubsts = 0;
+}
+
+
+/** ------------------------------ startSubsts --------------------------------
+ * Forks a child for every $(...) and `...` in word, which runs the command
+ *   as the shell would with its stdout on a pipe, and goes on without
+ *   waiting, so every substitution of a command runs at once
+ */
+static void startSubsts(const char *word)
+{
+   for (const char *mark = strpbrk(word, SUBST_MARKS); mark != NULL;
+        mark = strpbrk(mark + markLength(mark), SUBST_MARKS))
+   {
+      if (numSubsts == substCap)
+      {
+         int cap = substCap > 0 ? substCap * 2 : 8;
+         Subst *grown = realloc(substs, cap * sizeof(Subst));
+         if (grown == NULL)
+         {
+            return;                         // The rest come out empty
+         }
+         substs = grown;
+         substCap = cap;
+      }
+      Subst *sub = &substs[numSubsts];
+      int fds[2];
+      if (makePipe(fds, 0) == -1)
+      {
+         perror("Pipe failed");
+         return;
+      }
+
+      fflush(stdout);
+      sub->started = nowUsec();
+      sub->pid = fork();
+      if (sub->pid == 0)                    // A copy of the shell that
+      {                                     //   only runs the command
+         for (int s = 0; s < numSubsts; s++)
+         {
+            close(substs[s].fd);
+         }
+         numSubsts = 0;
+         close(fds[READ]);
+         dup2(fds[WRITE], STDOUT_FILENO);
+         close(fds[WRITE]);
+         interactive = 0;                   // No job control in there
+         for (int s = 0; s < NUM_JOB_SIGNALS; s++)
+         {
+            signal(jobSignals[s], SIG_DFL);
+         }
+         initEvents();                      // Its own event loop
+         traceFork();
+
+         Arena arena = { NULL };
+         size_t len = strchr(mark, SUBST_END) - mark - 1;
+         int status = runCommand(&arena, arenaStrndup(&arena, mark + 1, len));
+         fflush(stdout);
+         traceFlush();
+         _exit(status);
+      }
+      close(fds[WRITE]);
+      if (sub->pid < 0)
+      {
+         perror("Fork failed");
+         close(fds[READ]);
+         continue;
+      }
+
+      sub->at = mark;
+      sub->fd = fds[READ];
+      sub->output = NULL;
+      sub->len = 0;
+      sub->cap = 0;
+      numSubsts++;
+   }
+}
+
+
+/** ----------------------------- collectSubsts -------------------------------
+ * Reads every started substitution's output as it comes, with poll(), then
+ *   reaps the children and trims the trailing newlines off each output
+ * Their resources count towards the command's, for time and the log
+ */
+static void collectSubsts(void)
+{
+   struct pollfd fds[numSubsts > 0 ? numSubsts : 1];
+   int which[numSubsts > 0 ? numSubsts : 1];
+
+   for (;;)
+   {
+      int numFds = 0;
+      for (int s = 0; s < numSubsts; s++)
+      {
+         if (substs[s].fd != -1)
+         {
+            fds[numFds] = (struct pollfd){ substs[s].fd, POLLIN, 0 };
+            which[numFds++] = s;
+         }
+      }
+      if (numFds == 0)
+      {
+         break;
+      }
+      if (poll(fds, numFds, -1) == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("Substitution failed");
+         break;
+      }
+
+      for (int f = 0; f < numFds; f++)
+      {
+         Subst *sub = &substs[which[f]];
+         if (fds[f].revents == 0)
+         {
+            continue;
+         }
+         if (sub->cap - sub->len < 4096)    // Room for a full pipe read
+         {
+            size_t cap = sub->cap > 0 ? sub->cap * 2 : 8192;
+            char *grown = realloc(sub->output, cap);
+            if (grown == NULL)
+            {
+               perror("Out of memory");
+               exit(1);
+            }
+            sub->output = grown;
+            sub->cap = cap;
+         }
+         ssize_t got = read(sub->fd, sub->output + sub->len,
+                            sub->cap - sub->len - 1);
+         if (got > 0)
+         {
+            sub->len += got;
+         }
+         else if (got == 0 || errno != EINTR)
+         {
+            close(sub->fd);
+            sub->fd = -1;
+         }
+      }
+   }
+
+   for (int s = 0; s < numSubsts; s++)
+   {
+      Subst *sub = &substs[s];
+      int status;
+      struct rusage usage;
+      memset(&usage, 0, sizeof(usage));
+      if (sub->fd != -1)                    // After a poll() failure
+      {
+         close(sub->fd);
+         sub->fd = -1;
+      }
+      while (wait4(sub->pid, &status, 0, &usage) == -1 && errno == EINTR)
+      {
+      }
+      addUsage(&pipelineUsage, &usage);
+      if (acctFd != -1)
+      {
+         size_t len = strchr(sub->at, SUBST_END) - sub->at - 1;
+         char *argv = strndup(sub->at + 1, len);
+         logUsage(sub->pid, status, sub->started, &usage, argv);
+         free(argv);
+      }
+      substStatus = exitCode(status);
+
+      while (sub->len > 0 && sub->output[sub->len - 1] == '\n')
+      {
+         sub->len--;
+      }
+      if (sub->output != NULL)
+      {
+         sub->output[sub->len] = '\0';
+      }
+   }
+}
+
+
+/** ------------------------------- substWords --------------------------------
+ * Runs the substitutions of a NULL terminated list of words side by side,
+ *   for expandWords() to use their output
+ */
+static void substWords(char **words)
+{
+   clearSubsts();
+   for (; *words != NULL; words++)
+   {
+      startSubsts(*words);
+   }
+   collectSubsts();
+}
+
+
+/** ------------------------------ substOutput --------------------------------
+ * Returns what the substitution marked at mark printed, "" if it couldn't
+ *   be started
+ */
+static const char *substOutput(const char *mark)
+{
+   for (int s = 0; s < numSubsts; s++)
+   {
+      if (substs[s].at == mark)
+      {
+         return substs[s].output != NULL ? substs[s].output : "";
+      }
+   }
+   return "";
+}
+
+
+static char *expandText(Arena *arena, const char *word, int split);
+
+
+/** ------------------------------- refValue ----------------------------------
+ * Value of the variable reference marked at mark, "" for an unset
+ *   variable; num holds the text of $? $! and $$
+ * ${NAME:-WORD} is WORD when NAME is unset or empty, ${NAME-WORD} only when
+ *   it's unset: WORD loses its quotes and backslashes as a word would (only
+ *   the ones "..." keeps special inside a quoted reference) and its $
+ *   references are expanded too
+ * *split says whether the value is going to be split at blanks; WORD comes
+ *   back split already, with what was quoted in it kept whole, and then
+ *   *split is cleared
+ */
+static const char *refValue(Arena *arena, const char *mark, char *num,
+                            int *split)
+{
+   const char *ref = mark + 1;
+   size_t refLen = varRefLength(ref);
+
+   if (ref[0] == '{' && refLen == 3 && strchr("?!$", ref[1]) != NULL)
+   {
+      ref++;                                   // ${?} is $?
+      refLen = 1;
+   }
+   if (refLen == 1 && (ref[0] == '?' || ref[0] == '!' || ref[0] == '$'))
+   {
+      if (ref[0] == '!' && lastBgPid == 0)    // Nothing run with & yet
+      {
+         return "";
+      }
+      snprintf(num, 24, "%ld", ref[0] == '?' ? (long)lastStatus
+                               : ref[0] == '!' ? (long)lastBgPid
+                               : (long)getpid());
+      return num;
+   }
+
+   const char *name = ref;
+   size_t nameLen = refLen;
+   const char *word = NULL;                    // After :- or -
+   const char *end = ref + refLen - 1;         // The } of ${...}
+   int orEmpty = 0;
+   if (ref[0] == '{')
+   {
+      name = ref + 1;
+      nameLen = 0;
+      while (validName(name, nameLen + 1))
+      {
+         nameLen++;
+      }
+      const char *rest = name + nameLen;
+      orEmpty = rest[0] == ':';
+      if (nameLen > 0 && rest[orEmpty] == '-')
+      {
+         word = rest + orEmpty + 1;
+      }
+      else if (nameLen == 0 || rest != end)
+      {
+         fprintf(stderr, "Bad substitution: $%.*s\n", (int)refLen, ref);
+         return "";
+      }
+   }
+
+   const Var *var = findVar(name, nameLen);
+   const char *value = var->flags & VAR_SET
+                       ? var->text + var->nameLen + 1 : NULL;
+   if (word != NULL && (value == NULL || (orEmpty && value[0] == '\0')))
+   {
+      int quoted = *mark == EXPAND_QUOTED;
+      char *marked = arenaAlloc(arena, 2 * (end - word) + 1);
+      char *out = marked;
+      char inner = '\0';                      // A quote open inside WORD
+      for (const char *c = word; c < end; c++)
+      {
+         int doubled = quoted || inner == '"';
+         size_t len = *c == '$' && inner != '\'' ? varRefLength(c + 1) : 0;
+         if (len > 0)                          // Marked like the one it's in
+         {
+            int braced = c[1] != '{';          // $x"y" mustn't become $xy
+            *out++ = doubled ? EXPAND_QUOTED : EXPAND_PLAIN;
+            out += braced ? sprintf(out, "{%.*s}", (int)len, c + 1)
+                          : sprintf(out, "%.*s", (int)len, c + 1);
+            c += len;
+         }
+         else if (*c == '\\' && inner != '\'' && c + 1 < end
+                  && (!doubled || strchr("$`\"\\", c[1]) != NULL))
+         {
+            *out++ = *++c;
+         }
+         else if (inner != '\0' ? *c == inner
+                                : *c == '"' || (*c == '\'' && !quoted))
+         {
+            inner = inner != '\0' ? '\0' : *c;
+         }
+         else
+         {
+            int blank = *c == ' ' || *c == '\t' || *c == '\n';
+            *out++ = blank && *split && inner == '\0' ? FIELD_BREAK : *c;
+         }
+      }
+      *out = '\0';
+      char *text = expandText(arena, marked, *split);
+      *split = 0;
+      return text;
+   }
+   return value != NULL ? value : "";
+}
+
+
+/** ------------------------------- expandText --------------------------------
+ * Replaces every reference marked by lexLine() in word with its value and
+ *   every substitution with its output, into a string from arena
+ * With split, the blanks in the value of an unquoted one become a single
+ *   FIELD_BREAK each, for expandWords() to split the word at
+ */
+static char *expandText(Arena *arena, const char *word, int split)
+{
+   // Every reference's value is looked up once, then measured and copied
+   int numRefs = 0;
+   for (const char *c = word; *c != '\0'; c++)
+   {
+      numRefs += *c != '\0' && strchr(EXPAND_MARKS, *c) != NULL;
+   }
+   const char **values = arenaAlloc(arena, (numRefs + 1) * sizeof(char *));
+   char *presplit = arenaAlloc(arena, numRefs + 1);   // By refValue()
+   numRefs = 0;
+   for (const char *c = word; *c != '\0'; c++)
+   {
+      presplit[numRefs] = 0;
+      if (*c == SUBST_PLAIN || *c == SUBST_QUOTED)
+      {
+         values[numRefs++] = substOutput(c);
+         c += markLength(c);
+      }
+      else if (*c == EXPAND_PLAIN || *c == EXPAND_QUOTED)
+      {
+         char num[24];
+         int splitting = split && *c == EXPAND_PLAIN;
+         const char *value = refValue(arena, c, num, &splitting);
+         presplit[numRefs] = split && *c == EXPAND_PLAIN && !splitting;
+         values[numRefs++] = value == num
+                             ? arenaStrndup(arena, num, strlen(num)) : value;
+         c += markLength(c);
+      }
+   }
+
+   char *text = NULL;
+   size_t len = 0;
+   for (int pass = 0; pass < 2; pass++)
+   {
+      int broken = 0;                          // Last character a break
+      len = 0;
+      numRefs = 0;
+      for (const char *c = word; *c != '\0'; c++)
+      {
+         if (strchr(EXPAND_MARKS, *c) == NULL)
+         {
+            if (text != NULL)
+            {
+               text[len] = *c;
+            }
+            len++;
+            broken = 0;
+            continue;
+         }
+
+         int splitting = split && (*c == EXPAND_PLAIN || *c == SUBST_PLAIN)
+                         && !presplit[numRefs];
+         for (const char *v = values[numRefs++]; *v != '\0'; v++)
+         {
+            int blank = splitting && (*v == ' ' || *v == '\t' || *v == '\n');
+            if (blank && broken)
+            {
+               continue;
+            }
+            if (text != NULL)
+            {
+               text[len] = blank ? FIELD_BREAK : *v;
+            }
+            len++;
+            broken = blank;
+         }
+         c += markLength(c);
+      }
+      if (text == NULL)
+      {
+         text = arenaAlloc(arena, len + 1);
+      }
+   }
+   text[len] = '\0';
+   return text;
+}
+
+
+/** ------------------------------ expandWords --------------------------------
+ * Expands a NULL terminated list of words into the fields they make, from
+ *   arena: an unquoted reference's value is split at blanks, and a word
+ *   that comes to nothing is dropped unless it had a quoted reference
+ * Returns the NULL terminated fields
+ */
+static char **expandWords(Arena *arena, char **words)
+{
+   int numWords = 0;
+   size_t numFields = 0;
+
+   while (words[numWords] != NULL)
+   {
+      numWords++;
+   }
+   char **texts = arenaAlloc(arena, (numWords + 1) * sizeof(char *));
+   for (int w = 0; w < numWords; w++)
+   {
+      texts[w] = strpbrk(words[w], EXPAND_MARKS) != NULL
+                 ? expandText(arena, words[w], 1) : words[w];
+      numFields++;
+      for (const char *c = texts[w]; *c != '\0'; c++)
+      {
+         numFields += *c == FIELD_BREAK;
+      }
+   }
+
+   char **fields = arenaAlloc(arena, (numFields + 1) * sizeof(char *));
+   numFields = 0;
+   for (int w = 0; w < numWords; w++)
+   {
+      if (texts[w] == words[w])                // Nothing to expand
+      {
+         fields[numFields++] = words[w];
+         continue;
+      }
+
+      size_t before = numFields;
+      char *piece = texts[w];
+      for (;;)
+      {
+         char *brk = strchr(piece, FIELD_BREAK);
+         if (brk != NULL)
+         {
+            *brk = '\0';
+         }
+         if (piece[0] != '\0')
+         {
+            fields[numFields++] = piece;
+         }
+         if (brk == NULL)
+         {
+            break;
+         }
+         piece = brk + 1;
+      }
+      if (numFields == before && strpbrk(words[w], "\002\005") != NULL)
+      {
+         fields[numFields++] = texts[w];       // "$EMPTY" is still a word
+      }
+   }
+   fields[numFields] = NULL;
+   return fields;
+}
+
+
+/** ----------------------------- expandCommand -------------------------------
+ * Copies cmd into out with every stage's words expanded, from arena:
+ *   arguments split into fields, redirect targets and assigns as one word
+ * Every substitution in the pipeline is started before any is collected
+ */
+static void expandCommand(Arena *arena, const Command *cmd, Command *out)
+{
+   *out = *cmd;
+   out->stages = arenaAlloc(arena, cmd->numStages * sizeof(Stage));
+
+   clearSubsts();
+   for (int s = 0; s < cmd->numStages; s++)
+   {
+      const Stage *st = &cmd->stages[s];
+      for (int w = 0; st->argv[w] != NULL; w++)
+      {
+         startSubsts(st->argv[w]);
+      }
+      for (int r = 0; r < st->numRedirs; r++)
+      {
+         if (st->redirs[r].file != NULL)
+         {
+            startSubsts(st->redirs[r].file);
+         }
+      }
+      for (int a = 0; st->assigns != NULL && st->assigns[a] != NULL; a++)
+      {
+         startSubsts(st->assigns[a]);
+      }
+   }
+   collectSubsts();
+
+   for (int s = 0; s < cmd->numStages; s++)
+   {
+      const Stage *st = &cmd->stages[s];
+      Stage *copy = &out->stages[s];
+
+      *copy = *st;
+      copy->argv = expandWords(arena, st->argv);
+      copy->redirs = arenaAlloc(arena, st->numRedirs * sizeof(Redirect));
+      for (int r = 0; r < st->numRedirs; r++)
+      {
+         copy->redirs[r] = st->redirs[r];
+         if (st->redirs[r].file != NULL)
+         {
+            copy->redirs[r].file = expandText(arena, st->redirs[r].file, 0);
+         }
+      }
+      if (st->assigns != NULL)
+      {
+         int numAssigns = 0;
+         while (st->assigns[numAssigns] != NULL)
+         {
+            numAssigns++;
+         }
+         copy->assigns = arenaAlloc(arena, (numAssigns + 1) * sizeof(char *));
+         for (int a = 0; a <= numAssigns; a++)
+         {
+            copy->assigns[a] = st->assigns[a] != NULL
+                               ? expandText(arena, st->assigns[a], 0) : NULL;
+         }
+      }
+   }
+}
+
+
+/** ------------------------------ runParsed ----------------------------------
+ * Expands a parsed pipeline's $ references and substitutions, runs it as
+ *   a builtin or launches it, and reports its times if it started with time
+ * NAME=VALUE words alone set shell variables
+ * Returns the pipeline's exit code, exit also sets exitRequested
+ */
+static int runParsed(const Command *cmd)
+{
+   struct rusage self, selfAfter;
+   double started = nowUsec();
+   int status;
+   getrusage(RUSAGE_SELF, &self);
+   memset(&pipelineUsage, 0, sizeof(pipelineUsage));
+
+   Command expanded;
+   clearSubsts();
+   if (cmd->expand)
+   {
+      arenaReset(&wordArena);
+      expandCommand(&wordArena, cmd, &expanded);
+      cmd = &expanded;
+   }
+
+   const Stage *first = &cmd->stages[0];
+   if (cmd->numStages == 1 && first->argv[0] == NULL)
+   {
+      if (first->assigns != NULL)
+      {
+         setAssigns(first->assigns, 0);
+      }
+      return numSubsts > 0 ? substStatus : 0;  // Or it expanded to nothing
+   }
+
+   // A lone foreground builtin runs in the shell without a fork, unless
+   //   it's pinned with @cpus= (e.g. a timeout)
+   const Builtin *builtin = findBuiltin(first->argv[0]);
+   if (builtin != NULL && cmd->numStages == 1 && !cmd->bgProcess
+       && first->assigns == NULL && cmd->cpus == NULL)
+   {
+      status = runBuiltin(builtin, &cmd->stages[0]);
+
+      getrusage(RUSAGE_SELF, &selfAfter);      // What the shell itself used
+      timersub(&selfAfter.ru_utime, &self.ru_utime, &pipelineUsage.ru_utime);
+      timersub(&selfAfter.ru_stime, &self.ru_stime, &pipelineUsage.ru_stime);
+      pipelineUsage.ru_maxrss = selfAfter.ru_maxrss;
+   }
+
+   // Everything else is launched by the shell, builtins in a pipeline or
+   //   the background included
+   else
+   {
+      status = runPipeline(cmd->stages, cmd->numStages, cmd->bgProcess,
+                           cmd->text, cmd->cpus);
+   }
+
+   if (cmd->timed && !cmd->bgProcess)
+   {
+      printTimes(nowUsec() - started, &pipelineUsage);
+   }
+   return status;
+}
+
+
+/** ------------------------------ keepRunning --------------------------------
+ * Whether a list or loop should go on, not after exit or once ^C stopped
+ *   a command
+ */
+static int keepRunning(void)
+{
+   return !exitRequested && !interrupted;
+}
+
+
+/** -------------------------------- runNode ----------------------------------
+ * Runs a command tree in the shell itself, taking each condition from the
+ *   exit code of its (reaped) pipelines, so only pipelines that need a
+ *   process ever fork and a loop of builtins never does
+ * A for loop's variable is a shell variable
+ * Returns the exit code of the last thing run, which lastStatus gets too
+ */
+static int runNode(const Node *node)
+{
+   int status = 0;
+
+   switch (node->type)
+   {
+      case NODE_PIPELINE :
+         status = runParsed(&node->cmd);
+         break;
+
+      case NODE_LIST :
+         status = runNode(node->left);
+         if (keepRunning())
+         {
+            status = runNode(node->right);
+         }
+         break;
+
+      case NODE_AND :                        // The right side only runs if
+      case NODE_OR :                         //   the left one succeeded
+         status = runNode(node->left);       //   (or failed for ||)
+         if ((status == 0) == (node->type == NODE_AND) && keepRunning())
+         {
+            status = runNode(node->right);
+         }
+         break;
+
+      case NODE_NOT :
+         status = runNode(node->left) == 0;
+         break;
+
+      case NODE_IF :
+         status = runNode(node->left);
+         if (!keepRunning())
+         {
+            break;
+         }
+         if (status == 0)
+         {
+            status = runNode(node->right);
+         }
+         else
+         {
+            status = node->orElse != NULL ? runNode(node->orElse) : 0;
+         }
+         break;
+
+      case NODE_WHILE :
+      case NODE_UNTIL :
+         while (keepRunning())
+         {
+            int cond = runNode(node->left);
+            if ((cond == 0) != (node->type == NODE_WHILE) || !keepRunning())
+            {
+               break;
+            }
+            status = runNode(node->right);
+         }
+         break;
+
+      case NODE_FOR :
+      {
+         Arena values = { NULL };      // Its words, expanded once up front
+         substWords(node->words);
+         for (char **word = expandWords(&values, node->words);
+              *word != NULL && keepRunning(); word++)
+         {
+            setVar(node->name, strlen(node->name), *word);
+            status = runNode(node->right);
+         }
+         arenaFree(&values);
+         break;
+      }
+   }
+
+   lastStatus = status;
+   return status;
+}
+
+
+/** ----------------------------- findCachedTree ------------------------------
+ * Looks line up in the parse cache and makes it the newest entry
+ * Returns its command tree, or NULL if it isn't cached
+ */
+static const Node *findCachedTree(const char *line)
+{
+   unsigned long hash = hashLine(line);
+   CacheEntry *entry = cacheSlots[hash % PARSE_CACHE_SLOTS];
+
+   while (entry != NULL && (entry->hash != hash
+                            || strcmp(entry->line, line) != 0))
+   {
+      entry = entry->next;
+   }
+   if (entry == NULL || entry == cacheNewest)
+   {
+      return entry != NULL ? entry->root : NULL;
+   }
+
+   // Unlink it and put it in front of the newest
+   entry->newer->older = entry->older;
+   if (entry->older != NULL)
+   {
+      entry->older->newer = entry->newer;
+   }
+   else
+   {
+      cacheOldest = entry->newer;
+   }
+   entry->older = cacheNewest;
+   entry->newer = NULL;
+   cacheNewest->newer = entry;
+   cacheNewest = entry;
+   return entry->root;
+}
+
+
+/** ------------------------------- cacheTree ---------------------------------
+ * Makes entry (with its line and tree filled in) the newest entry of the
+ *   parse cache, freeing the oldest one if it's full
+ */
+static void cacheTree(CacheEntry *entry)
+{
+   if (cacheCount == PARSE_CACHE_SIZE)       // Make room
+   {
+      CacheEntry *oldest = cacheOldest;
+      CacheEntry **link = &cacheSlots[oldest->hash % PARSE_CACHE_SLOTS];
+      while (*link != oldest)
+      {
+         link = &(*link)->next;
+      }
+      *link = oldest->next;
+      cacheOldest = oldest->newer;
+      if (cacheOldest != NULL)
+      {
+         cacheOldest->older = NULL;
+      }
+      Arena blocks = oldest->arena;          // oldest is in there too
+      arenaFree(&blocks);
+      cacheCount--;
+   }
+
+   entry->hash = hashLine(entry->line);
+   entry->next = cacheSlots[entry->hash % PARSE_CACHE_SLOTS];
+   cacheSlots[entry->hash % PARSE_CACHE_SLOTS] = entry;
+   entry->older = cacheNewest;
+   entry->newer = NULL;
+   if (cacheNewest != NULL)
+   {
+      cacheNewest->newer = entry;
+   }
+   cacheNewest = entry;
+   if (cacheOldest == NULL)
+   {
+      cacheOldest = entry;
+   }
+   cacheCount++;
+}
+
+
+/** ------------------------------- parseLine ---------------------------------
+ * Parses a command line into a command tree, a line seen recently is taken
+ *   from the parse cache instead of being lexed and parsed again
+ * The tree is built in an arena of its own along with a copy of the line,
+ *   which the cache keeps, only the tokens come from arena
+ * Returns 0 with *root set (NULL for an empty line), 2 (after printing why)
+ *   for a syntax error, or CMD_INCOMPLETE if the line ends in the middle of
+ *   a command, e.g. inside an if or quotes or after | && or ||
+ */
+static int parseLine(Arena *arena, const char *line, const Node **root)
+{
+   *root = findCachedTree(line);
+   if (*root != NULL)
+   {
+      return 0;
+   }
+
+   // The cache entry, the line as typed and a copy lexLine() unquotes
+   Arena keep = { NULL };
+   size_t len = strlen(line);
+   CacheEntry *entry = arenaAlloc(&keep, sizeof(CacheEntry));
+   entry->line = arenaStrndup(&keep, line, len);
+   char *text = arenaStrndup(&keep, line, len);
+
+   Token *tokens;
+   uint64_t started = traceNow();
+   int numTokens = lexLine(arena, text, &tokens);
+   traceEvent(TRACE_LEX, NULL, started);
+   Parser p = { tokens, numTokens, 0, &keep, entry->line,
+                numTokens == -2 ? CMD_INCOMPLETE : 0 };
+   started = traceNow();
+   Node *tree = p.status == 0 ? parseList(&p, NULL) : NULL;
+   traceEvent(TRACE_PARSE, NULL, started);
+   if (tree == NULL)
+   {
+      arenaFree(&keep);                      // Errors aren't cached
+      return p.status;
+   }
+
+   entry->root = tree;
+   entry->arena = keep;
+   cacheTree(entry);
+   *root = tree;
+   return 0;
+}
+
+
+/** ------------------------------ runCommand ---------------------------------
+ * Parses and runs one complete command line
+ * Returns its exit code, exit also sets exitRequested
+ */
+static int runCommand(Arena *arena, const char *theCommand)
+{
+   const Node *root;
+   int status = parseLine(arena, theCommand, &root);
+
+   if (status == CMD_INCOMPLETE)
+   {
+      fprintf(stderr, "Syntax error: unexpected end of input\n");
+      return 2;
+   }
+   return status != 0 || root == NULL ? status : runNode(root);
+}
+
+
+/** ---------------------------- compareDoubles -------------------------------
+ * qsort() order for latencies
+ */
+static int compareDoubles(const void *a, const void *b)
+{
+   double x = *(const double *)a;
+   double y = *(const double *)b;
+
+   return (x > y) - (x < y);
+}
+
+
+/** ----------------------------- benchCommand --------------------------------
+ * Runs text through runCommand() the same way a line read by main() is
+ */
+static void benchCommand(Arena *arena, const char *text)
+{
+   arenaReset(arena);
+   notifyJobs();
+   runCommand(arena, arenaStrndup(arena, text, strlen(text)));
+}
+
+
+/** ----------------------------- runBenchmark --------------------------------
+ * osh --bench [N] runs each workload N times with every launcher and prints
+ *   commands/sec and p50/p99 launch-to-exit latency, then the throughput of
+ *   a two stage pipe at a few pipe sizes (with the size the kernel really
+ *   gave) and peak RSS
+ * Workloads:
+ *   builtin      true        (runs inside the shell, nothing is launched)
+ *   trivial      /usr/bin/true or wherever PATH has it
+ *   redirect     cat < FILE > FILE
+ *   pipe         cat FILE | cat | cat        (FILE is 64 KiB)
+ *   background   /usr/bin/true &   (latency is launch only, joined by wait
+ *                                  every 64 commands)
+ *   startup      osh -c :          (this binary started cold, to compare
+ *   minimal      osh --minimal -c :  with a -flto -static build of it)
+ * The commands' own output goes to /dev/null while they're timed
+ */
+static int runBenchmark(int iterations)
+{
+   char dir[] = "/tmp/osh-bench-XXXXXX";
+   char inFile[64], outFile[64];
+   char trueCmd[PATH_MAX], trueBgCmd[PATH_MAX + 2];
+   char redirectCmd[160], pipeCmd[160];
+   char shellPath[PATH_MAX];
+   char startupCmd[PATH_MAX + 16], minimalCmd[PATH_MAX + 32];
+   Arena arena = { NULL };
+   int savedLauncher = launcher;
+
+   if (iterations < 1 || mkdtemp(dir) == NULL)
+   {
+      fprintf(stderr, "osh: can't set up benchmark: %s\n",
+              iterations < 1 ? "bad iteration count" : strerror(errno));
+      return 1;
+   }
+   snprintf(inFile, sizeof(inFile), "%s/in", dir);
+   snprintf(outFile, sizeof(outFile), "%s/out", dir);
+   snprintf(redirectCmd, sizeof(redirectCmd), "cat < %s > %s",
+            inFile, outFile);
+   snprintf(pipeCmd, sizeof(pipeCmd), "cat %s | cat | cat", inFile);
+   const char *truePath = lookupCommand("true");  // Not the builtin true
+   snprintf(trueCmd, sizeof(trueCmd), "%s",
+            truePath != NULL ? truePath : "/bin/true");
+   snprintf(trueBgCmd, sizeof(trueBgCmd), "%s &", trueCmd);
+   ssize_t pathLen = readlink("/proc/self/exe", shellPath, PATH_MAX - 1);
+   shellPath[pathLen > 0 ? pathLen : 0] = '\0';
+   snprintf(startupCmd, sizeof(startupCmd), "'%s' -c :", shellPath);
+   snprintf(minimalCmd, sizeof(minimalCmd), "'%s' --minimal -c :",
+            shellPath);
+
+   FILE *in = fopen(inFile, "w");
+   for (int i = 0; in != NULL && i < 1024; i++)
+   {
+      fprintf(in, "%063d\n", i);              // 64 KiB of lines
+   }
+   if (in != NULL)
+   {
+      fclose(in);
+   }
+
+   const struct { const char *name; const char *command; int bg; } work[] =
+   {
+      { "builtin", "true", 0 },
+      { "trivial", trueCmd, 0 },
+      { "redirect", redirectCmd, 0 },
+      { "pipe", pipeCmd, 0 },
+      { "background", trueBgCmd, 1 },
+      { "startup", startupCmd, 0 },
+      { "minimal", minimalCmd, 0 },
+   };
+   double *latency = malloc(iterations * sizeof(double));
+   int devNull = open("/dev/null", O_WRONLY);
+   int savedOut = dup(STDOUT_FILENO);
+
+   printf("%-11s %-8s %10s %10s %10s\n",
+          "workload", "launcher", "cmds/sec", "p50 usec", "p99 usec");
+   for (int l = LAUNCH_FORK; l <= LAUNCH_SPAWN; l++)
+   {
+      launcher = l;
+      for (size_t w = 0; w < sizeof(work) / sizeof(work[0]); w++)
+      {
+         fflush(stdout);
+         dup2(devNull, STDOUT_FILENO);
+
+         double start = nowUsec();
+         for (int i = 0; i < iterations; i++)
+         {
+            double t = nowUsec();
+            benchCommand(&arena, work[w].command);
+            latency[i] = nowUsec() - t;
+
+            if (work[w].bg && (i % 64 == 63 || i == iterations - 1))
+            {
+               benchCommand(&arena, "wait");  // Join the batch
+            }
+         }
+         double total = nowUsec() - start;
+
+         fflush(stdout);
+         dup2(savedOut, STDOUT_FILENO);
+
+         qsort(latency, iterations, sizeof(double), compareDoubles);
+         printf("%-11s %-8s %10.0f %10.1f %10.1f\n", work[w].name,
+                launcherNames[l], iterations / (total / 1e6),
+                latency[iterations / 2], latency[iterations * 99 / 100]);
+      }
+   }
+   launcher = savedLauncher;
+
+   // Pipe throughput between two stages at a few pipe sizes
+   const long long pipeBytes = 256LL << 20;
+   const long sizes[] = { 0, 256 << 10, 1 << 20 };
+   long savedPipeSize = pipeSize;
+   char throughputCmd[96];
+   snprintf(throughputCmd, sizeof(throughputCmd),
+            "head -c %lld /dev/zero | cat", pipeBytes);
+   printf("pipe throughput (%s):\n", throughputCmd);
+   printf("%12s %12s %10s\n", "pipesize", "achieved", "MB/s");
+
+   for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++)
+   {
+      pipeSize = sizes[z];
+      fflush(stdout);
+      dup2(devNull, STDOUT_FILENO);
+      double start = nowUsec();
+      benchCommand(&arena, throughputCmd);
+      double elapsed = nowUsec() - start;
+      fflush(stdout);
+      dup2(savedOut, STDOUT_FILENO);
+
+      char requested[24];
+      snprintf(requested, sizeof(requested), "%ld", sizes[z]);
+      printf("%12s %12ld %10.1f\n", sizes[z] == 0 ? "default" : requested,
+             lastPipeSize, pipeBytes / (elapsed / 1e6) / 1e6);
+   }
+   pipeSize = savedPipeSize;
+
+   struct rusage self, children;
+   getrusage(RUSAGE_SELF, &self);
+   getrusage(RUSAGE_CHILDREN, &children);
+   printf("peak RSS: shell %.1f MB, largest child %.1f MB\n",
+          self.ru_maxrss / 1024.0, children.ru_maxrss / 1024.0);
+
+   close(devNull);
+   close(savedOut);
+   free(latency);
+   free(arena.head);
+   unlink(inFile);
+   unlink(outFile);
+   rmdir(dir);
+   return 0;
+}
+
+
+/** ------------------------------- openInput ---------------------------------
+ * Picks where commands come from based on the command line
+ *   osh               stdin, interactively if it's a terminal
+ *   osh -c 'cmds'     the given text
+ *   osh script.osh    the given file
+ * Non-interactive input is read through a large buffer in one pass
+ * Returns NULL (after printing why) if the input can't be opened
+ */
+static FILE *openInput(int argc, char *argv[])
+{
+   static char inputBuffer[1 << 16];
+   FILE *input = stdin;
+
+   if (argc > 1 && strcmp(argv[1], "-c") == 0)
+   {
+      if (argc < 3)
+      {
+         fprintf(stderr, "osh: -c needs a command\n");
+         return NULL;
+      }
+      input = fmemopen(argv[2], strlen(argv[2]), "r");
+   }
+   else if (argc > 1)
+   {
+      input = fopen(argv[1], "r");
+   }
+
+   if (input == NULL)
+   {
+      perror(argc > 1 ? argv[argc > 2 ? 2 : 1] : "osh");
+      return NULL;
+   }
+
+   interactive = input == stdin && isatty(STDIN_FILENO);
+   if (!interactive)
+   {
+      setvbuf(input, inputBuffer, _IOFBF, sizeof(inputBuffer));
+   }
+   return input;
+}
+
+
+/** ----------------------------- onInputTimeout ------------------------------
+ * Timer for TMOUT, ends the wait for a line
+ */
+static void onInputTimeout(void *arg)
+{
+   (void)arg;
+   inputTimedOut = 1;
+}
+
+
+/** ------------------------------- readLine ----------------------------------
+ * Reads one line of input without its \n into *line, through the line
+ *   editor when typing at a terminal, prompting only when interactive
+ * An interactive shell waits in the event loop, so background jobs are
+ *   reaped meanwhile, and gives up after TMOUT seconds if it's set
+ * Returns its length, or -1 at the end of input
+ */
+static ssize_t readLine(FILE *input, const char *prompt, char **line,
+                        size_t *lineSize)
+{
+   ssize_t lineLen = -1;
+   const char *idle = interactive ? getVar("TMOUT") : NULL;
+   int timer = idle != NULL && atol(idle) > 0
+               ? addTimer(atol(idle) * 1e6, onInputTimeout, NULL) : -1;
+
+   inputTimedOut = 0;
+   if (interactive && editing)
+   {
+      lineLen = editLine(prompt, line, lineSize);
+   }
+   else
+   {
+      if (interactive && minimal)
+      {
+         if (write(STDOUT_FILENO, prompt, strlen(prompt)) == -1)
+         {
+            lineLen = -1;                 // Nowhere to prompt, stop
+         }
+      }
+      else if (interactive)
+      {
+         printf("%s", prompt);            // Print shell line starter
+         fflush(stdout);                  // Flush output
+      }
+      if (!interactive || waitInput(fileno(input), 0) == 1)
+      {
+         lineLen = getline(line, lineSize, input);
+      }
+      if (lineLen > 0 && (*line)[lineLen - 1] == '\n')
+      {
+         (*line)[--lineLen] = '\0';       // Remove \n
+      }
+   }
+
+   cancelTimer(timer);
+   if (inputTimedOut)
+   {
+      fprintf(stderr, "\nTimed out waiting for input: auto-logout");
+   }
+   return lineLen;
+}
+
+
+/** -------------------------------- main -------------------------------------
+ * The shell functions by accepting a user input and forking with the child
+ *   calling execvp() using the entered text as tokenized arguments
+ *   where args[0] is the command to be executed
+ * The child can also be started with vfork() or posix_spawnp(), which skip
+ *   copying the shell's memory (see OSH_LAUNCHER and "set launcher=")
+ * Command locations are remembered in a hash table so PATH is only walked
+ *   the first time a command is used (see the hash builtin)
+ * Builtins are found in a sorted table before anything is launched, a lone
+ *   builtin runs in the shell itself with its redirects applied to the
+ *   shell's descriptors and undone afterwards
+ * cat without options is handled by the shell, which moves the data with
+ *   splice()/sendfile() in a forked child instead of executing /bin/cat
+ * Input lines can be any length, everything parsed from a line lives in a
+ *   per-command arena that is emptied before the next line is read
+ * A line is parsed into a tree of pipelines, && || ; lists and if, while,
+ *   until and for commands, which the shell runs itself; one that isn't
+ *   finished (an open if, a quote, a trailing |) goes on over the lines
+ *   read after it with a > prompt
+ * The last 256 distinct lines keep what they parsed to in an LRU cache,
+ *   so a line that comes around again (a script's loop body, !!) skips
+ *   lexing and parsing
+ * Commands can also come from -c 'text' or a script file, then there's no
+ *   banner or prompt, lines starting with # are skipped, and the shell
+ *   exits with the status of the last command once the input ends
+ * osh --bench [N] times a set of workloads through the same code instead
+ * osh --minimal ... starts with as little as it can for wrappers that run
+ *   it many times: no banner, history file or line editor, unbuffered
+ *   stdout, and -c text is parsed and run whole without a FILE around it
+ * 
+ *
+ * Lines are split into words and operators in one pass, with quotes and
+ *   backslash escapes, and operators don't need spaces around them
+ *
+ * Assumptions:
+ * If outputting to an existing file the data is okay to be erased or is 
+ *   backed up, as this program will erase contents before outputting
+ */
+int main(int argc, char *argv[])
+{
+   int should_run = 1; /* flag to determine when to exit program */
+   char *line = NULL;   /* input buffer, grown by getline() as needed */
+   size_t lineSize = 0;
+   Arena arena = { NULL }; /* everything parsed from the current command */
+
+   // osh --minimal ... skips the banner, history and stdio buffering
+   if (argc > 1 && strcmp(argv[1], "--minimal") == 0)
+   {
+      minimal = 1;
+      argv[1] = argv[0];
+      argv++;
+      argc--;
+      setvbuf(stdout, NULL, _IONBF, 0);  // Every printf() is one write()
+   }
+
+   // Launcher can be picked before startup, e.g. OSH_LAUNCHER=spawn
+   initVars();                        // The environment, as variables
+
+   const char *launcherEnv = getVar("OSH_LAUNCHER");
+   if (launcherEnv != NULL && setLauncher(launcherEnv) == -1)
+   {
+      fprintf(stderr, "Unknown OSH_LAUNCHER %s, using fork\n", launcherEnv);
+   }
+
+   // Per child accounting can be on from the start, e.g. OSH_ACCTLOG=FILE
+   const char *acctEnv = getVar("OSH_ACCTLOG");
+   if (acctEnv != NULL)
+   {
+      openAcctLog(acctEnv);
+   }
+
+   // Tracing too, OSH_TRACE=FILE (Chrome trace JSON for FILE.json)
+   const char *traceEnv = getVar("OSH_TRACE");
+   if (traceEnv != NULL)
+   {
+      traceOpen(traceEnv);
+   }
+
+   // Children, input and timers are all waited for in one place
+   if (initEvents() == -1)
+   {
+      perror("Event loop failed");
+      return 1;
+   }
+
+   // osh --bench [N] measures the launch paths instead of reading commands
+   if (argc > 1 && strcmp(argv[1], "--bench") == 0)
+   {
+      return runBenchmark(argc > 2 ? atoi(argv[2]) : 1000);
+   }
+
+   // Minimal -c text needs no FILE or line loop, it's parsed in one go
+   if (minimal && argc > 2 && strcmp(argv[1], "-c") == 0)
+   {
+      lastStatus = runCommand(&arena, argv[2]);
+      traceOpen("off");
+      return lastStatus;
+   }
+
+   FILE *input = openInput(argc, argv);
+   if (input == NULL)
+   {
+      return 127;
+   }
+
+   if (interactive)
+   {
+      initJobControl();                   // ^C and ^Z go to the jobs
+   }
+   if (interactive && minimal)
+   {
+      editing = 0;                        // Plain reads, nothing saved
+   }
+   else if (interactive)
+   {
+      historyOpen();                      // Only typed commands are saved
+      const char *term = getVar("TERM");
+      editing = term != NULL && strcmp(term, "dumb") != 0;
+      printf("Unix C Shell by Korosh Moosavi. Begin typing commands, or type \"exit\" to quit.\n");
+   }
+
+   while (should_run)
+   {
+      char *theCommand;                   // The entered command
+
+      arenaReset(&arena);                 // Drop the previous command
+      notifyJobs();                       // Collect finished & commands
+      traceFlush();                       // What the last command traced
+
+      uint64_t reading = traceNow();
+      ssize_t lineLen = readLine(input, "osh> ", &line, &lineSize);
+      traceEvent(TRACE_READ, NULL, reading);
+      if (lineLen == -1)                  // End of input
+      {
+         if (interactive)
+         {
+            printf("\n");                 // Leave the terminal on a new line
+         }
+         break;
+      }
+      theCommand = line;
+      while (*theCommand == ' ' || *theCommand == '\t')
+      {
+         theCommand++;                    // Skip indentation
+      }
+
+      // Empty input or a comment
+      if (theCommand[0] == '\0' || theCommand[0] == '#')
+      {
+         continue;
+      }
+
+      // Check for history (!!, !n, !-n or !prefix)
+      int recalled = theCommand[0] == '!' && theCommand[1] != '\0'
+                     && strpbrk(theCommand, " \t") == NULL;
+      if (recalled)                       // History call
+      {
+         theCommand = historyRecall(&arena, theCommand);
+         if (theCommand == NULL)          // No such previous command
+         {
+            continue;
+         }
+         printf("Previous command: %s\n", theCommand);
+      }
+
+      // Read on while the command isn't finished, e.g. inside an if
+      const Node *root;
+      int status = parseLine(&arena, theCommand, &root);
+      while (status == CMD_INCOMPLETE)
+      {
+         size_t len = strlen(theCommand);
+         char *sofar = arenaStrndup(&arena, theCommand, len);
+         reading = traceNow();
+         lineLen = readLine(input, "> ", &line, &lineSize);
+         traceEvent(TRACE_READ, NULL, reading);
+         if (lineLen == -1)
+         {
+            fprintf(stderr, "Syntax error: unexpected end of input\n");
+            status = 2;
+            break;
+         }
+         theCommand = arenaAlloc(&arena, len + lineLen + 2);
+         memcpy(theCommand, sofar, len);
+         theCommand[len] = '\n';
+         memcpy(theCommand + len + 1, line, lineLen + 1);
+         status = parseLine(&arena, theCommand, &root);
+      }
+
+      // New command
+      if (!recalled)
+      {
+         historyAdd(strchr(theCommand, '\n') != NULL      // Copy command to
+                    ? flattenLines(&arena, theCommand)     //   history
+                    : theCommand);
+      }
+
+      interrupted = 0;
+      lastStatus = status == 0 && root != NULL ? runNode(root) : status;
+      if (exitRequested)
+      {
+         should_run = 0;
+      }
+   }
+
+   free(line);
+   if (input != stdin)
+   {
+      fclose(input);
    }
+   traceOpen("off");                      // Writes out the rest
+   return lastStatus;
 }